@@ -0,0 +1,16 @@
+#ifndef IVANP_BROTLI_HH
+#define IVANP_BROTLI_HH
+
+#include <cstddef>
+
+namespace brotli {
+
+void compress_alloc(
+  const char* in, size_t in_size,
+  char*& out, size_t& out_size,
+  int quality = 11
+);
+
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef IVANP_ENCODING_HH
+#define IVANP_ENCODING_HH
+
+#include <cstdint>
+#include <array>
+#include <algorithm>
+#include <initializer_list>
+
+namespace ivanp {
+
+// content codings of response bodies
+enum class encoding: uint8_t { identity, gzip, br, zstd };
+inline constexpr unsigned n_encodings = 4;
+
+inline const char* encoding_name(encoding e) noexcept {
+  switch (e) {
+    case encoding::gzip: return "gzip";
+    case encoding::br  : return "br";
+    case encoding::zstd: return "zstd";
+    default            : return "identity";
+  }
+}
+
+// suffix of precompressed files on disk
+inline const char* encoding_suffix(encoding e) noexcept {
+  switch (e) {
+    case encoding::gzip: return ".gz";
+    case encoding::br  : return ".br";
+    case encoding::zstd: return ".zst";
+    default            : return "";
+  }
+}
+
+// acceptable encodings other than identity, most preferred first
+class encoding_list {
+  std::array<encoding,n_encodings> e;
+  uint8_t n = 0;
+
+public:
+  encoding_list() noexcept = default;
+  encoding_list(std::initializer_list<encoding> l) noexcept
+  : n(std::min<size_t>(l.size(),n_encodings)) {
+    std::copy_n(l.begin(), n, e.begin());
+  }
+
+  void push_back(encoding x) noexcept { if (n < n_encodings) e[n++] = x; }
+
+  bool empty() const noexcept { return !n; }
+  auto begin() const noexcept { return e.begin(); }
+  auto end  () const noexcept { return e.begin()+n; }
+  bool contains(encoding x) const noexcept {
+    return std::find(begin(),end(),x) != end();
+  }
+};
+
+}
+
+#endif
@@ -2,40 +2,116 @@
 #define IVANP_FILE_CACHE_HH
 
 #include <string_view>
-#include <ctime>
+#include <utility>
+#include <memory>
+#include <string>
+#include <functional>
+#include <thread>
+#include <algorithm>
+#include <initializer_list>
+
+#include "encoding.hh"
 
 namespace ivanp {
 
-struct locked_cache_view {
+// keeps the cache entry alive, not the cache locked
+// if data is null, fd is an open file owned by entry, use positional io
+struct cache_view {
   const char* data = nullptr;
   size_t size = 0;
-  bool gz = false;
+  encoding enc = encoding::identity;
   int fd = -1;
+  std::shared_ptr<const void> entry;
+  std::string_view response; // head followed by data, if preassembled
+
+  cache_view() noexcept = default;
+  cache_view(
+    const char* data, size_t size, encoding enc, int fd,
+    std::shared_ptr<const void> entry = { }
+  ) noexcept
+  : data(data), size(size), enc(enc), fd(fd), entry(std::move(entry)) { }
 
-  ~locked_cache_view();
-  locked_cache_view(const locked_cache_view&) = delete;
-  locked_cache_view& operator=(const locked_cache_view&) = delete;
-  locked_cache_view(locked_cache_view&& o) noexcept
-  : data(o.data), size(o.size), gz(o.gz) {
+  cache_view(const cache_view&) = delete;
+  cache_view& operator=(const cache_view&) = delete;
+  cache_view(cache_view&& o) noexcept
+  : data(o.data), size(o.size), enc(o.enc), fd(o.fd),
+    entry(std::move(o.entry)), response(o.response)
+  {
     o.data = nullptr;
     o.size = 0;
     o.fd = -1;
   }
-  locked_cache_view& operator=(locked_cache_view&& o) noexcept {
+  cache_view& operator=(cache_view&& o) noexcept {
     std::swap(data,o.data);
     std::swap(size,o.size);
-    std::swap(gz,o.gz);
+    std::swap(enc,o.enc);
     std::swap(fd,o.fd);
+    std::swap(entry,o.entry);
+    std::swap(response,o.response);
     return *this;
   }
   operator std::string_view() const noexcept {
-    return data ? { data, size } : { };
+    return data ? std::string_view(data,size) : std::string_view();
   }
 };
 
 inline size_t file_cache_max_size = 1 << 20;
+inline size_t file_cache_max_total = 64 << 20; // eviction threshold, whole pages
+// complete responses are kept for hot files up to this size
+inline size_t file_cache_response_max_size = 64 << 10;
+// open files kept for uncached and large files
+inline size_t file_cache_max_fds = 256;
+
+// low priority threads building compressed variants
+// brotli and zstd are built at their highest levels
+inline unsigned file_cache_compress_threads =
+  std::max(std::thread::hardware_concurrency()/4, 1u);
+// files at least this large are compressed on all the threads at once
+inline size_t file_cache_parallel_min = 1 << 18;
+
+// compressed variants are persisted here across restarts,
+// keyed by content hash and encoder settings, nullptr disables
+// old variants are not pruned
+inline const char* file_cache_store = ".cache/variants";
+
+// map cached files instead of reading them into private memory
+// only safe if files are replaced by rename(), since accessing a mapping
+// of a file truncated in place raises SIGBUS
+inline bool file_cache_mmap = false;
+
+// only files under watched directories are cached
+// the first available of the accepted encodings is served
+// precompressed name.gz, name.br and name.zst files are used if not older
+// than the file, missing variants are built in the background,
+// and a less preferred variant or identity is served meanwhile
+// cached entries are invalidated by inotify events instead of mtime checks
+cache_view file_cache(const char* name, const encoding_list& accept);
 
-locked_cache_view file_cache(const char* name, bool gz);
+// serializes the status line and headers for a body
+using response_head = std::function<std::string(encoding, size_t size)>;
+
+// the head is called once per variant of a hot file, the complete response
+// is then kept with the variant, so that a hit can be sent with one write
+cache_view file_cache(
+  const char* name, const encoding_list& accept, const response_head& head);
+
+// loads a file bypassing admission and builds its variants on this thread
+void file_cache_warm(const char* name, const encoding_list& encodings);
+
+// call once, before serving
+void file_cache_watch(std::initializer_list<const char*> dirs);
+
+struct file_cache_stats {
+  size_t hits, misses, evictions,
+         rejected, // misses not admitted into the cache
+         invalidations, // entries marked stale because the file changed
+         stale, // stale entries served during a reload
+         loads, compressions,
+         restored, // variants mapped from the store instead of compressed
+         fd_hits; // opens avoided for uncached files
+  size_t entries, bytes, fds;
+};
+file_cache_stats get_file_cache_stats() noexcept;
 
 }
 
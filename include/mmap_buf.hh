@@ -0,0 +1,73 @@
+#ifndef IVANP_MMAP_BUF_HH
+#define IVANP_MMAP_BUF_HH
+
+#include <cstddef>
+#include <string_view>
+#include <initializer_list>
+#include <utility>
+#include <atomic>
+
+namespace ivanp {
+
+// refcounted mmap()ed region, unmapped when the last reference is dropped
+struct mmap_region {
+  void* addr;
+  size_t size;
+  std::atomic<unsigned> refs = 1;
+
+  mmap_region(void* addr, size_t size) noexcept: addr(addr), size(size) { }
+  void release() noexcept;
+};
+
+// read-only view of memory held by an mmap_region
+class mmap_buf {
+  const char* m = nullptr;
+  size_t len = 0;
+  mmap_region* r = nullptr;
+
+public:
+  mmap_buf() noexcept = default;
+  mmap_buf(const char* m, size_t len, mmap_region* r) noexcept
+  : m(m), len(len), r(r) { }
+  ~mmap_buf() { if (r) r->release(); }
+
+  mmap_buf(const mmap_buf&) = delete;
+  mmap_buf& operator=(const mmap_buf&) = delete;
+  mmap_buf(mmap_buf&& o) noexcept
+  : m(o.m), len(o.len), r(o.r) {
+    o.m = nullptr;
+    o.len = 0;
+    o.r = nullptr;
+  }
+  mmap_buf& operator=(mmap_buf&& o) noexcept {
+    std::swap(m,o.m);
+    std::swap(len,o.len);
+    std::swap(r,o.r);
+    return *this;
+  }
+
+  // shared read-only mapping of the file, backed by the page cache
+  // empty if size is 0
+  static mmap_buf map(int fd, size_t size);
+  // private anonymous copy of the file
+  static mmap_buf read(int fd, size_t size);
+  // private anonymous copy of the concatenation of the parts
+  static mmap_buf copy(std::initializer_list<std::string_view> parts);
+  static mmap_buf copy(const char* data, size_t size) {
+    return copy({{data,size}});
+  }
+
+  const char* data() const noexcept { return m; }
+  size_t size() const noexcept { return len; }
+  // bytes held by the mapping, whole pages
+  size_t mapped() const noexcept { return r ? r->size : 0; }
+  explicit operator bool() const noexcept { return m; }
+  operator std::string_view() const noexcept { return { m, len }; }
+};
+
+// files at least this large are advised to use transparent huge pages
+inline size_t mmap_hugepage_min_size = 2 << 20;
+
+} // end namespace ivanp
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef IVANP_RCU_HH
+#define IVANP_RCU_HH
+
+// Epoch-based read-copy-update.
+// Readers mark the epoch in which they started, writers publish new
+// versions of a structure atomically and retire the old ones, which are
+// deleted once every reader that could still see them has finished.
+
+namespace ivanp::rcu {
+
+void read_lock() noexcept;
+void read_unlock() noexcept;
+
+struct read_guard {
+  read_guard() noexcept { read_lock(); }
+  ~read_guard() { read_unlock(); }
+  read_guard(const read_guard&) = delete;
+  read_guard& operator=(const read_guard&) = delete;
+};
+
+// must be called after the pointer to p was replaced
+void retire(void* p, void(*del)(void*));
+
+template <typename T>
+void retire(T* p) {
+  retire(const_cast<void*>(static_cast<const void*>(p)),
+    [](void* p){ delete static_cast<T*>(p); });
+}
+
+} // end namespace ivanp::rcu
+
+#endif
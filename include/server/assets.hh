@@ -0,0 +1,57 @@
+#ifndef IVANP_ASSETS_HH
+#define IVANP_ASSETS_HH
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <initializer_list>
+
+namespace ivanp::http {
+
+struct asset {
+  std::string name; // file name
+  const char* mime;
+  bool compressible;
+};
+
+// immutable map from URL paths to files, built once at startup
+// files added later are not served until restart,
+// changes to listed files are picked up by the file cache
+class asset_manifest {
+  struct string_hash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const noexcept {
+      return std::hash<std::string_view>{}(s);
+    }
+  };
+  std::unordered_map<std::string,asset,string_hash,std::equal_to<>> assets;
+  std::vector<asset> unlisted;
+
+public:
+  struct mount {
+    const char* url; // nullptr to only warm up
+    const char* path; // directories are scanned recursively
+  };
+  // a directory's files are served at url followed by their relative path
+  asset_manifest(std::initializer_list<mount> mounts);
+
+  asset_manifest(const asset_manifest&) = delete;
+  asset_manifest& operator=(const asset_manifest&) = delete;
+
+  // loads every file into the file cache and builds its compressed
+  // variants, nthreads = 0 uses all cores
+  void warm(unsigned nthreads = 0) const;
+
+  // no syscalls
+  const asset* operator[](std::string_view url) const noexcept {
+    const auto it = assets.find(url);
+    return it != assets.end() ? &it->second : nullptr;
+  }
+
+  size_t size() const noexcept { return assets.size(); }
+};
+
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef IVANP_HEARTBEAT_HH
+#define IVANP_HEARTBEAT_HH
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+#include "server/websocket.hh"
+
+namespace ivanp::websocket {
+
+// pings connections from a timing wheel and hangs up on the ones that
+// don't answer, so that half-open connections don't stay around
+// a connection is pinged if nothing was received from it for interval
+// ticks, then gets timeout ticks to answer the ping,
+// and timeout ticks more to answer the close frame that follows
+// the socket is only shut down, its reader closes it on EOF
+class heartbeat {
+  std::mutex mx;
+  std::condition_variable_any cv;
+  // the slot at (pos + n) % size is due in n ticks
+  std::vector<std::vector<std::weak_ptr<connection>>> wheel;
+  size_t pos = 0, added = 0;
+  const unsigned interval, timeout;
+  std::jthread thread;
+
+  void run(std::stop_token, std::chrono::milliseconds tick);
+
+public:
+  heartbeat(
+    std::chrono::milliseconds tick, unsigned interval, unsigned timeout);
+
+  // not owned, dropped once destroyed or closed
+  // new connections are spread over the interval
+  void add(std::shared_ptr<connection>);
+
+  size_t size();
+};
+
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include <array>
 
 #include "socket.hh"
+#include "encoding.hh"
 #include "error.hh"
 
 namespace ivanp::http {
@@ -119,16 +120,66 @@ public:
   }
 };
 
+// encodings accepted by the client, ordered by q-value
+encoding_list accept_encoding(const request&);
+
 std::string header(
   std::string_view mime, size_t len, std::string_view more={}
 );
 
+std::string chunked_header(
+  std::string_view mime, std::string_view more={}
+);
+
+// gzip-compresses a body of unknown length as it is written
+// and sends it using chunked transfer encoding
+// uses per-thread state, only one can be active on a thread at a time
+class gzip_chunked {
+  socket sock;
+  std::string header;
+  char *buf, *out;
+  bool done = false;
+
+  void flush(bool last = false);
+
+public:
+  inline static size_t chunk_size = 1 << 16;
+  // smaller bodies are sent uncompressed, the gzip header, trailer
+  // and chunk framing would outweigh what compression saves
+  inline static size_t min_size = 256;
+
+  gzip_chunked(socket sock, std::string header);
+  gzip_chunked(const gzip_chunked&) = delete;
+  gzip_chunked& operator=(const gzip_chunked&) = delete;
+
+  void write(std::string_view);
+  void finish();
+};
+
+struct file_type {
+  const char* mime;
+  bool compressible;
+};
+// by file name extension
+file_type get_file_type(const char* name) noexcept;
+
+struct asset;
+
+// responses of compressible types carry Vary: Accept-Encoding
+void send_file(
+  socket, const char* name, const encoding_list& accept={}
+);
+void send_file(
+  socket, const asset&, const encoding_list& accept={}
+);
 void send_file(
-  socket, const char* name, bool gz=false
+  socket, const char* name, const char* mime, bool compressible,
+  const encoding_list& accept={}
 );
 
 void send_str(
-  socket, std::string_view str, std::string_view mime, bool gz=false
+  socket, std::string_view str, std::string_view ext,
+  const encoding_list& accept={}
 );
 
 } // end namespace http
@@ -0,0 +1,47 @@
+#ifndef IVANP_PAGE_TEMPLATE_HH
+#define IVANP_PAGE_TEMPLATE_HH
+
+#include <string_view>
+#include <utility>
+#include <memory>
+#include <atomic>
+#include <initializer_list>
+
+#include "socket.hh"
+#include "encoding.hh"
+
+namespace ivanp::http {
+
+// html page with <!-- type:name --> slots, where type is
+//   html - text escaped for html
+//   js   - escaped for the inside of a javascript string literal
+//   raw  - inserted as is
+// other comments are left in place
+// the page is compiled on first use into fragments and slots,
+// and recompiled when the file cache reports it changed
+// fragments are also deflated once, gzip responses splice them with the
+// values in stored blocks, so rendering compresses nothing
+class page_template {
+  const char* name;
+  struct compiled;
+  mutable std::atomic<std::shared_ptr<const compiled>> page;
+
+  std::shared_ptr<const compiled> get() const;
+
+public:
+  explicit page_template(const char* name);
+  ~page_template();
+  page_template(const page_template&) = delete;
+  page_template& operator=(const page_template&) = delete;
+
+  using values = std::initializer_list<
+    std::pair<std::string_view,std::string_view> >;
+
+  // one write of the headers, fragments and escaped values
+  // slots without a value are left empty
+  void send(socket, values, const encoding_list& accept = { }) const;
+};
+
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef IVANP_PUBSUB_HH
+#define IVANP_PUBSUB_HH
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+
+#include "server/websocket.hh"
+#include "task_pool.hh"
+#include "spsc_queue.hh"
+
+namespace ivanp::websocket {
+
+// rooms of connections
+// a published message is encoded once per kind of connection
+// and the same frame is written to every member
+//
+// with owners, each connection is only written to by the thread that
+// owns it, which reads it too
+// a message for another owner's members is posted to a mailbox, one per
+// pair of threads, and the owner is woken to drain it
+// posts that don't fit wait in the poster's spill, in order, and are
+// moved in by the poster once the owner has made room
+class pubsub {
+  using members = std::vector<std::shared_ptr<connection>>;
+  using room = std::vector<members>; // by owner
+
+  struct str_hash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const noexcept {
+      return std::hash<std::string_view>{}(s);
+    }
+  };
+
+  std::mutex mx;
+  // copied on change, so that publishing only holds a reference
+  std::unordered_map<
+    std::string, std::shared_ptr<const room>, str_hash, std::equal_to<>
+  > rooms;
+  struct membership {
+    unsigned owner;
+    std::vector<std::string> rooms;
+  };
+  std::unordered_map<const connection*,membership> joined;
+
+  // without owners
+  task_pool* pool = nullptr; // never destroyed, the workers are detached
+
+  // with owners
+  const unsigned nowners = 1;
+  std::function<void(unsigned)> wake;
+  struct post {
+    std::shared_ptr<const message> m;
+    std::shared_ptr<const room> to; // its members of the owner
+  };
+  std::unique_ptr<std::unique_ptr<spsc_queue<post>>[]> boxes; // to, from
+  std::unique_ptr<std::deque<post>[]> spills; // to, from, only used by from
+  struct alignas(64) flag { std::atomic<bool> set = false; };
+  std::unique_ptr<flag[]> pending; // woken, but not drained yet
+  std::unique_ptr<flag[]> spilled; // to, from, the spill isn't empty
+
+  void leave_locked(std::string_view room, const connection*, unsigned owner);
+  void notify(unsigned owner);
+  void post_to(unsigned to, unsigned from, post&&);
+  bool unspill(unsigned to, unsigned from);
+
+public:
+  static constexpr unsigned no_owner = -1;
+
+  // larger rooms are written to in batches of this many on the pool
+  inline static size_t batch_size = 256;
+
+  explicit pubsub(unsigned nthreads = std::thread::hardware_concurrency())
+  : pool(new task_pool(nthreads)) { }
+
+  // wake(owner) must make that owner's thread call drain(owner)
+  pubsub(
+    unsigned nowners, std::function<void(unsigned)> wake,
+    size_t mailbox_size = 1 << 10);
+
+  void join(
+    std::string_view room, std::shared_ptr<connection>,
+    unsigned owner = 0);
+  void leave(std::string_view room, const connection*);
+  void leave(const connection*); // all rooms
+
+  // with owners, from is the owner calling this, if it is one
+  void publish(
+    std::string_view room, std::shared_ptr<const message>,
+    unsigned from = no_owner);
+  void publish(
+    std::string_view room, std::string_view payload,
+    head::type opcode = head::text, unsigned from = no_owner
+  ) {
+    publish(room, std::make_shared<const message>(
+      std::string(payload), opcode), from);
+  }
+
+  // writes what was posted to the owner's members,
+  // and moves the owner's spilled posts into the mailboxes
+  void drain(unsigned owner);
+
+  size_t size(std::string_view room);
+};
+
+}
+
+#endif
@@ -4,12 +4,16 @@
 #include <cstdint>
 #include <cstdlib>
 #include <vector>
+#include <queue>
+#include <memory>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
 #include <iostream>
 #include <utility>
 
 #include "server/socket.hh"
-#include "thread_safe_queue.hh"
 
 struct epoll_event; // <sys/epoll.h>
 
@@ -22,7 +26,31 @@ public:
 private:
   uniq_socket main_socket, epoll;
   std::vector<std::thread> threads;
-  thread_safe_queue<socket> queue;
+  inline static thread_local unsigned this_worker = -1;
+
+  // events of pinned sockets only go to their owner,
+  // the others to whichever worker is free,
+  // so that a slow send only holds up the sockets it has to
+  class job_queues {
+    std::mutex mx;
+    std::queue<socket> shared;
+    struct worker {
+      std::queue<socket> own;
+      std::condition_variable cv;
+    };
+    std::vector<std::unique_ptr<worker>> workers;
+    std::vector<unsigned> idle; // waiting for a job
+    std::unordered_set<int> pinned;
+
+  public:
+    unsigned add_worker();
+    unsigned size() const noexcept { return workers.size(); }
+    void push(socket); // to the owner, if pinned
+    void push(unsigned worker, socket);
+    socket pop(unsigned worker);
+    void pin(int fd);
+    void unpin(int fd);
+  } jobs;
   epoll_event* epoll_events;
   const unsigned n_epoll_events;
   const int epoll_timeout;
@@ -57,6 +85,22 @@ public:
 
   void loop() noexcept;
 
+  // keep an accepted socket open and also wake on EPOLLOUT,
+  // so that queued writes can be flushed
+  void watch_writable(int);
+
+  // the worker that handles the socket once pinned, so that the state
+  // kept for it is only used by one thread and stays in that core's cache
+  unsigned owner(int fd) const noexcept { return fd % jobs.size(); }
+  void pin(int fd) { jobs.pin(fd); }
+  // before the socket is closed, so that its fd isn't pinned when reused
+  void unpin(int fd) { jobs.unpin(fd); }
+  // of the calling thread, -1 if it isn't a worker
+  static unsigned worker() noexcept { return this_worker; }
+  // calls the worker's function with a socket of -1
+  void wake(unsigned worker) { jobs.push(worker,-1); }
+
+  // must be called before loop
   template <typename F>
   void operator()(
     unsigned nthreads, size_t buffer_size,
@@ -64,13 +108,15 @@ public:
   ) noexcept {
     threads.reserve(threads.size()+nthreads);
     for (unsigned i=0; i<nthreads; ++i) {
-      threads.emplace_back([ &queue = this->queue,
+      threads.emplace_back([ &jobs = this->jobs,
+        index = jobs.add_worker(),
         worker_function,
         buffer = thread_buffer(buffer_size)
       ]() mutable {
+        this_worker = index;
         for (;;) {
           try {
-            worker_function(queue.pop(), buffer.m, buffer.size);
+            worker_function(jobs.pop(index), buffer.m, buffer.size);
           } catch (const std::exception& e) {
             std::cerr << "\033[31;1m" << e.what() << "\033[0m" << std::endl;
           }
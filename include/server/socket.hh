@@ -4,6 +4,10 @@
 #include <string_view>
 #include <utility>
 
+#include <sys/types.h>
+
+struct iovec;
+
 namespace ivanp {
 
 class socket {
@@ -32,6 +36,12 @@ public:
 
   void write(const char* data, size_t size) const;
   void write(std::string_view s) const { write(s.data(),s.size()); }
+  // gathered write, iov is modified
+  void write(iovec* iov, int iovcnt) const;
+  // doesn't wait, returns -1 if nothing can be written yet
+  ssize_t try_write(const iovec* iov, int iovcnt) const;
+  // from a file, doesn't change its offset
+  void sendfile(int in_fd, size_t offset, size_t size) const;
   socket operator<<(std::string_view buffer) const {
     write(buffer);
     return *this;
@@ -40,8 +50,12 @@ public:
   size_t read(char* buffer, size_t size) const;
   template <typename T>
   size_t read(T& buffer) const { return read(buffer.data(),buffer.size()); }
+  // doesn't wait, returns -1 if there's nothing to read yet
+  ssize_t try_read(char* buffer, size_t size) const;
 
   void close() const noexcept;
+  // hangs up both ways, but keeps the fd, so it can't be reused yet
+  void shutdown() const noexcept;
 };
 
 struct uniq_socket: socket {
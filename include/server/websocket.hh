@@ -1,8 +1,20 @@
 #ifndef IVANP_WEBSOCKET_HH
 #define IVANP_WEBSOCKET_HH
 
+#include <string>
+#include <memory>
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <functional>
+
 #include "server/http.hh"
 
+namespace zlib {
+class deflate_stream;
+class inflate_stream;
+}
+
 namespace ivanp::websocket {
 
 struct head {
@@ -17,6 +29,20 @@ struct head {
   enum : type {
     cont='\x0', text='\x1', bin='\x2', close='\x8', ping='\x9', pong='\xA'
   };
+  static constexpr type rsv1 = 4; // compressed message
+
+  bool control() const noexcept { return opcode & 0x8; }
+};
+
+// status codes of close frames
+enum close_code: uint16_t {
+  normal = 1000,
+  going_away = 1001,
+  protocol_error = 1002,
+  invalid_data = 1007,
+  policy_violation = 1008,
+  too_big = 1009,
+  internal_error = 1011
 };
 
 struct frame: head {
@@ -35,17 +61,250 @@ struct frame: head {
   friend decltype(auto) operator<<(T& o, const frame& f) noexcept {
     return o << f.payload;
   }
+};
 
-  bool control(file_desc&);
+// a decoded frame header
+struct frame_head: head {
+  uint64_t size; // payload length
+  char key[4]; // masking key
 };
 
-void handshake(file_desc&, const http::request& req);
-frame parse_frame(char* buff, size_t size);
-frame receive_frame(file_desc&, char* buff, size_t size);
-void send_frame(
-  file_desc& sock, char* buffer, size_t size,
-  std::string_view message, head::type opcode = head::text
-);
+// returns the length of the header, 0 if buff doesn't hold all of it
+size_t parse_head(const char* buff, size_t size, frame_head& h);
+
+// xors data with the mask, in place
+// phase is the offset of data in the payload, for split payloads
+void unmask(char* data, size_t size, const char* mask, size_t phase = 0)
+noexcept;
+
+// the kernels unmask() picks from, exposed for benchmarks
+// m holds the mask bytes in the order they apply starting at data
+namespace unmask_kernels {
+void bytes(char* data, size_t size, const char* m) noexcept;
+void words(char* data, size_t size, const char* m) noexcept;
+#if defined(__x86_64__) || defined(__i386__)
+void sse2(char* data, size_t size, const char* m) noexcept;
+void avx2(char* data, size_t size, const char* m) noexcept; // if supported
+#endif
+}
+
+// text messages must be valid UTF-8 --------------------------------
+// validation of a message that arrives in parts
+struct utf8_state {
+  uint8_t prev[3] { }; // last bytes seen, oldest first
+  bool error = false;
+
+  // valid so far, and no sequence was cut short by the end
+  bool complete() const noexcept {
+    return !error && prev[2] < 0xC0 && prev[1] < 0xE0 && prev[0] < 0xF0;
+  }
+};
+void validate_utf8(const char* data, size_t size, utf8_state&) noexcept;
+inline bool valid_utf8(std::string_view s) noexcept {
+  utf8_state st;
+  validate_utf8(s.data(),s.size(),st);
+  return st.complete();
+}
+// unmasks and validates in the same pass
+void unmask(
+  char* data, size_t size, const char* mask, size_t phase, utf8_state&
+) noexcept;
+
+// permessage-deflate, RFC 7692 ------------------------------------
+inline bool deflate_enabled = true;
+inline int deflate_level = 6;
+inline int deflate_window_bits = 15; // 9 to 15
+// keeping the window between messages costs a stream per connection,
+// without it broadcasts are compressed once for all recipients
+inline bool deflate_context_takeover = false;
+// if false, clients are asked not to keep theirs,
+// so that inflate streams are only held during a message
+inline bool deflate_client_context_takeover = false;
+// smaller messages are sent uncompressed
+inline size_t deflate_min_size = 64;
+
+// negotiated parameters
+struct deflate_params {
+  bool enabled = false;
+  bool server_context_takeover = false;
+  bool client_context_takeover = true;
+  uint8_t server_window_bits = 15;
+};
+
+// checks an upgrade request, returning the 101 response,
+// deflate is set to the accepted permessage-deflate offer, if any
+// the client may send frames as soon as it gets the response,
+// so the connection should be registered before it is sent
+std::string handshake(const http::request& req, deflate_params& deflate);
+
+// longer messages are rejected, counting all fragments
+// and the inflated size of compressed ones
+inline size_t max_message_size = 1 << 24;
+
+// a message for many connections, each kind of connection gets
+// a complete frame encoded once and shared, thread safe
+class message {
+  std::string payload;
+  // uncompressed, then deflated by window bits if smaller
+  // the uncompressed variant only has a header, its payload is not copied
+  mutable struct variant {
+    std::once_flag once;
+    char head[10];
+    uint8_t head_size = 0;
+    std::string payload;
+  } variants[1+16-9];
+
+public:
+  const head::type opcode;
+
+  explicit message(std::string payload, head::type opcode = head::text)
+  noexcept: payload(std::move(payload)), opcode(opcode) { }
+
+  std::string_view data() const noexcept { return payload; }
+  struct parts { std::string_view head, payload; };
+  // frame for a connection that negotiated d
+  parts frame(const deflate_params& d) const;
+};
+
+// outbound queues -------------------------------------------------
+// what to do with a frame that doesn't fit in a connection's queue
+enum class overflow: uint8_t {
+  drop_oldest, // drop queued frames, oldest first, until it fits
+  coalesce,    // drop all queued frames, the new one supersedes them
+  disconnect   // hang up, the connection's reader then closes it
+};
+inline overflow overflow_policy = overflow::drop_oldest;
+// control frames count too, a queue full of them hangs up instead
+inline size_t max_queued_bytes = 1 << 20; // per connection
+inline size_t max_queued_frames = 1 << 10;
+
+struct queue_stats {
+  size_t frames, bytes, // queued now, across connections
+         max_bytes, // deepest a single queue has been
+         dropped, // frames dropped or superseded on overflow
+         disconnected, // connections closed on overflow
+         blocked; // flushes stopped by a full socket buffer
+};
+queue_stats get_queue_stats() noexcept;
+
+// state of a websocket across frames
+// receive must not be called concurrently, send, flush and close may be
+// sends are queued, so that slow readers don't block the sender
+class connection {
+  socket sock;
+  std::mutex mx_write; // guards the queue and writing
+  bool closed = false;
+  bool stream;
+
+  struct out_frame {
+    std::shared_ptr<const void> owner; // keeps data alive
+    std::string_view data;
+    char head[10];
+    uint8_t head_size;
+    bool control; // never dropped, the connection is hung up instead
+    size_t size() const noexcept { return head_size + data.size(); }
+  };
+  std::deque<out_frame> out;
+  size_t out_sent = 0; // of the first frame
+  size_t out_bytes = 0; // not yet sent
+
+  // liveness, driven by a heartbeat
+  enum class beat_state: uint8_t { idle, pinged, ponged, closing };
+  beat_state beat = beat_state::idle;
+  uint32_t ping_id = 0; // payload of the last ping
+  std::atomic<bool> heard = false; // received anything since the last tick
+
+  utf8_state utf8; // of the text message being received
+
+  head::type msg_opcode = head::cont; // cont if no message is in progress
+  bool msg_compressed = false;
+  size_t msg_size = 0, msg_inflated = 0;
+  std::string msg; // fragments received so far, unless streaming
+
+  deflate_params deflate;
+  std::unique_ptr<zlib::inflate_stream> inflater;
+  std::unique_ptr<zlib::deflate_stream> deflater; // with context takeover
+
+  // data frame being received
+  // its payload is consumed as it arrives, so the bytes kept between
+  // reads are at most an incomplete header or control frame
+  frame_head cur;
+  uint64_t left = 0, phase = 0;
+  bool in_frame = false;
+  uint8_t ncarry = 0;
+  char carry[2+4+125];
+
+public:
+  // gets text and bin messages with fin set
+  // if streaming, gets them in parts as they arrive, fin set on the last
+  using handler = std::function<void(const frame&)>;
+
+private:
+  bool decode(char* p, size_t n, const handler& f);
+  // sends a close frame and hangs up, returns false
+  bool fail(uint16_t code, std::string_view reason);
+  // returns false if a text message isn't valid UTF-8
+  bool inflate(const char* p, size_t n, bool last, const handler& f);
+  // with mx_write locked ------
+  void write(
+    std::string_view payload, head::type opcode, bool compressed,
+    std::shared_ptr<const void> owner = nullptr);
+  // payload is copied if it has no owner and has to be queued
+  void enqueue(
+    std::shared_ptr<const void> owner,
+    std::string_view head, std::string_view payload, bool control);
+  bool make_room(size_t size, bool control);
+  void pop_front() noexcept;
+  bool flush_locked();
+  void close_locked() noexcept;
+  void hang_up_locked() noexcept;
+  void send_close(uint16_t code, std::string_view reason);
+
+public:
+  connection(
+    socket sock, deflate_params deflate = { }, bool stream = false
+  ) noexcept;
+  ~connection();
+
+  socket fd() const noexcept { return sock; }
+
+  // closes the socket, later sends are dropped
+  // only once nothing else refers to the fd, which can then be reused
+  void close() noexcept;
+  // starts the closing handshake, later sends are dropped
+  // the socket is shut down when the peer answers or the heartbeat gives up
+  void close(uint16_t code, std::string_view reason = { });
+  // hangs up without closing the fd, which others might still use
+  // the reader then sees EOF
+  void shutdown() noexcept;
+
+  // advances the heartbeat, pinging if nothing was heard for a while
+  // returns the number of ticks until the next call,
+  // or 0 once closed, shutting it down if the peer stopped responding
+  unsigned tick(unsigned interval, unsigned timeout);
+
+  // reads until the socket would block, handling all complete frames
+  // buffer is scratch space that f must not write to
+  // control frames are answered here
+  // returns false once the connection is over, the socket is then
+  // shut down but left open, unregister it before calling close()
+  bool receive(char* buffer, size_t size, const handler& f);
+
+  // compressed if negotiated and worthwhile
+  void send(std::string_view payload, head::type opcode = head::text) {
+    send(nullptr,payload,opcode);
+  }
+  // payload is referenced, not copied, for as long as owner is held
+  void send(
+    std::shared_ptr<const void> owner, std::string_view payload,
+    head::type opcode = head::text);
+  void send(std::shared_ptr<const message>);
+
+  // writes queued frames until the socket would block
+  // returns true if the queue was emptied
+  bool flush();
+  size_t queued_bytes();
+};
 
 }
 
@@ -0,0 +1,57 @@
+#ifndef IVANP_SPSC_QUEUE_HH
+#define IVANP_SPSC_QUEUE_HH
+
+#include <atomic>
+#include <memory>
+#include <bit>
+#include <utility>
+
+// bounded lock-free ring for one producer and one consumer thread
+// each side caches the other's index and only rereads it when the ring
+// looks full or empty, so the indices' cache lines rarely bounce
+template <typename T>
+class spsc_queue {
+  const size_t mask;
+  const std::unique_ptr<T[]> buf;
+
+  // written by the producer
+  alignas(64) std::atomic<size_t> tail = 0;
+  size_t head_cache = 0;
+  // written by the consumer
+  alignas(64) std::atomic<size_t> head = 0;
+  size_t tail_cache = 0;
+
+public:
+  // capacity is rounded up to a power of 2
+  explicit spsc_queue(size_t capacity)
+  : mask(std::bit_ceil(capacity < 2 ? 2 : capacity) - 1),
+    buf(new T[mask+1]) { }
+  spsc_queue(const spsc_queue&) = delete;
+  spsc_queue& operator=(const spsc_queue&) = delete;
+
+  // producer, false if full
+  bool try_push(T&& x) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head_cache > mask) {
+      head_cache = head.load(std::memory_order_acquire);
+      if (t - head_cache > mask) return false;
+    }
+    buf[t & mask] = std::move(x);
+    tail.store(t+1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer, false if empty
+  bool try_pop(T& x) {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail_cache) {
+      tail_cache = tail.load(std::memory_order_acquire);
+      if (h == tail_cache) return false;
+    }
+    x = std::exchange(buf[h & mask], T());
+    head.store(h+1, std::memory_order_release);
+    return true;
+  }
+};
+
+#endif
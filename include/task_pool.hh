@@ -0,0 +1,45 @@
+#ifndef IVANP_TASK_POOL_HH
+#define IVANP_TASK_POOL_HH
+
+#include <functional>
+#include <thread>
+#include <iostream>
+
+#include <sys/resource.h>
+
+#include "thread_safe_queue.hh"
+
+namespace ivanp {
+
+// detached worker threads running queued tasks
+// nice > 0 lowers the priority of the workers
+class task_pool {
+  thread_safe_queue<std::function<void()>> queue;
+
+public:
+  task_pool(unsigned nthreads, int nice = 0) {
+    if (nthreads == 0) nthreads = 1;
+    for (unsigned i=0; i<nthreads; ++i) {
+      std::thread([this,nice]{
+        // on linux the priority is per thread
+        if (nice) ::setpriority(PRIO_PROCESS, 0, nice);
+        for (;;) {
+          try {
+            queue.pop()();
+          } catch (const std::exception& e) {
+            std::cerr << "\033[31;1m" << e.what() << "\033[0m" << std::endl;
+          }
+        }
+      }).detach();
+    }
+  }
+  task_pool(const task_pool&) = delete;
+  task_pool& operator=(const task_pool&) = delete;
+
+  template <typename F>
+  void push(F&& f) { queue.push(std::forward<F>(f)); }
+};
+
+}
+
+#endif
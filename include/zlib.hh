@@ -11,6 +11,75 @@ void deflate_alloc(
   bool gz = true
 );
 
+// gzip on multiple threads, nthreads = 0 uses all cores
+void deflate_parallel(
+  const char* in, size_t in_size,
+  char*& out, size_t& out_size,
+  unsigned nthreads = 0, size_t block_size = 1 << 17
+);
+
+// raw deflate ending with a sync flush, byte aligned and without a final
+// block, so that it can be spliced into a larger stream
+void deflate_splice(
+  const char* in, size_t in_size,
+  char*& out, size_t& out_size
+);
+
+unsigned long crc32(unsigned long crc, const char* in, size_t in_size);
+// crc of the concatenation, len2 is the length of the second part
+unsigned long crc32_combine(
+  unsigned long crc1, unsigned long crc2, size_t len2);
+
+// incremental deflate, reset between bodies instead of reinitialized
+// window_bits as in zlib, +16 for gzip, negative for raw deflate
+class deflate_stream {
+  void* zs;
+
+public:
+  explicit deflate_stream(
+    int level = 6, int window_bits = 15|16, int mem_level = 8);
+  ~deflate_stream();
+  deflate_stream(const deflate_stream&) = delete;
+  deflate_stream& operator=(const deflate_stream&) = delete;
+
+  // gzip stream owned by the calling thread
+  static deflate_stream& local();
+
+  void reset();
+
+  // consumes input and fills output, advancing both
+  // returns true once finish was requested and all output was produced
+  bool operator()(
+    const char*& in, size_t& in_size,
+    char*& out, size_t& out_size,
+    bool finish = false
+  );
+
+  // flushes pending output to a byte boundary, ending with 00 00 ff ff
+  // returns true once all of it fit
+  bool sync_flush(char*& out, size_t& out_size);
+};
+
+// incremental inflate, window_bits as for deflate_stream
+class inflate_stream {
+  void* zs;
+
+public:
+  explicit inflate_stream(int window_bits = -15);
+  ~inflate_stream();
+  inflate_stream(const inflate_stream&) = delete;
+  inflate_stream& operator=(const inflate_stream&) = delete;
+
+  void reset();
+
+  // consumes input and fills output, advancing both
+  // returns true at the end of the compressed stream
+  bool operator()(
+    const char*& in, size_t& in_size,
+    char*& out, size_t& out_size
+  );
+};
+
 }
 
 #endif
@@ -0,0 +1,19 @@
+#ifndef IVANP_ZSTD_HH
+#define IVANP_ZSTD_HH
+
+#include <cstddef>
+
+namespace zstd {
+
+// false if built without libzstd, .zst files can still be served
+extern const bool available;
+
+void compress_alloc(
+  const char* in, size_t in_size,
+  char*& out, size_t& out_size,
+  int level = 19
+);
+
+}
+
+#endif
@@ -0,0 +1,60 @@
+// throughput of the websocket unmasking kernels by payload size
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+
+#include "server/websocket.hh"
+
+using namespace ivanp::websocket;
+
+namespace {
+
+using kernel = void(*)(char*, size_t, const char*) noexcept;
+
+// GB/s, over about the same total bytes for every size
+double bench(kernel f, char* p, size_t n, const char* m) {
+  const size_t reps = std::max(size_t(1 << 28) / n, size_t(4));
+  f(p,n,m); // warm up
+  const auto t0 = std::chrono::steady_clock::now();
+  for (size_t i=0; i<reps; ++i) {
+    f(p,n,m);
+    asm volatile("" :: "r"(p) : "memory"); // keep every pass
+  }
+  const std::chrono::duration<double> t =
+    std::chrono::steady_clock::now() - t0;
+  return double(n) * reps / t.count() * 1e-9;
+}
+
+}
+
+int main() {
+  struct { const char* name; kernel f; } kernels[] {
+    { "bytes", unmask_kernels::bytes },
+    { "words", unmask_kernels::words },
+#if defined(__x86_64__) || defined(__i386__)
+    { "sse2", unmask_kernels::sse2 },
+    { "avx2", __builtin_cpu_supports("avx2") ? unmask_kernels::avx2 : nullptr },
+#endif
+  };
+  constexpr size_t max_size = 16 << 20;
+  // payloads follow a 2 to 14 byte header, so are rarely aligned
+  const std::unique_ptr<char[]> buf(new char[max_size+64]);
+  char* const p = buf.get() + 6;
+  for (size_t i=0; i<max_size; ++i) p[i] = char(i*131);
+  const char m[4] { 0x12, 0x34, 0x56, 0x78 };
+
+  std::cout << "GB/s\n" << std::setw(10) << "size";
+  for (const auto& k : kernels) std::cout << std::setw(8) << k.name;
+  std::cout << std::fixed << std::setprecision(2) << '\n';
+  for (size_t n = 16; n <= max_size; n *= 4) {
+    std::cout << std::setw(10) << n;
+    for (const auto& k : kernels) {
+      if (k.f) std::cout << std::setw(8) << bench(k.f,p,n,m);
+      else std::cout << std::setw(8) << '-';
+    }
+    std::cout << std::endl;
+  }
+}
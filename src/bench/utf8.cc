@@ -0,0 +1,96 @@
+// cost of validating websocket text while unmasking it,
+// against unmasking alone and against a separate validation pass
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <algorithm>
+
+#include "server/websocket.hh"
+
+using namespace ivanp::websocket;
+
+namespace {
+
+// each mask byte keeps these valid, so that text unmasked twice,
+// i.e. masked again, is still valid text of the same kind
+constexpr char mask[4] { 1, 2, 3, 1 };
+constexpr const char* ascii[] { "The quick brown fox ", "jumps over 12 dogs. " };
+constexpr const char* mixed[] {
+  "chat ", "Привет, ", "мир! ", "你好世界", "😀 ", "ok\n"
+};
+
+// whole words, padded with spaces, so that no sequence is cut at the end
+std::string text(const auto& words, size_t size) {
+  std::string s;
+  for (size_t i=0; ; ++i) {
+    const std::string_view w = words[i % std::size(words)];
+    if (s.size() + w.size() > size) break;
+    s += w;
+  }
+  s.resize(size,' ');
+  return s;
+}
+
+// ms per GB, over about the same total bytes for every size
+template <typename F>
+double bench(F&& f, char* p, size_t n) {
+  const size_t reps = std::max(size_t(1 << 28) / n, size_t(4));
+  f(p,n); // warm up
+  const auto t0 = std::chrono::steady_clock::now();
+  for (size_t i=0; i<reps; ++i) {
+    f(p,n);
+    asm volatile("" :: "r"(p) : "memory"); // keep every pass
+  }
+  const std::chrono::duration<double> t =
+    std::chrono::steady_clock::now() - t0;
+  return t.count() / (double(n) * reps) * 1e12;
+}
+
+bool failed = false;
+
+void unmask_only(char* p, size_t n) { unmask(p,n,mask); }
+void fused(char* p, size_t n) {
+  utf8_state st;
+  unmask(p,n,mask,0,st);
+  failed |= !st.complete();
+}
+void two_pass(char* p, size_t n) {
+  utf8_state st;
+  unmask(p,n,mask);
+  validate_utf8(p,n,st);
+  failed |= !st.complete();
+}
+
+}
+
+int main() {
+  constexpr size_t max_size = 16 << 20;
+  struct { const char* name; std::string (*text)(size_t); } texts[] {
+    { "ascii", [](size_t n){ return text(ascii,n); } },
+    { "mixed", [](size_t n){ return text(mixed,n); } }
+  };
+
+  std::cout << "ms/GB\n" << std::setw(10) << "size";
+  for (const auto& t : texts)
+    for (const char* col : { "unmask", "fused", "2pass" })
+      std::cout << std::setw(13) << (std::string(t.name) + ' ' + col);
+  std::cout << std::fixed << std::setprecision(0) << '\n';
+  for (size_t n = 16; n <= max_size; n *= 4) {
+    std::cout << std::setw(10) << n;
+    for (auto& t : texts) {
+      // payloads follow a 2 to 14 byte header, so are rarely aligned
+      std::string buf(6,'\0');
+      buf += t.text(n);
+      char* const p = buf.data() + 6;
+      for (auto* f : { unmask_only, fused, two_pass })
+        std::cout << std::setw(13) << bench(f,p,n);
+    }
+    std::cout << std::endl;
+  }
+  if (failed) {
+    std::cerr << "invalid text" << std::endl;
+    return 1;
+  }
+}
@@ -0,0 +1,28 @@
+#include "brotli.hh"
+
+#include <cstdlib>
+
+#include <brotli/encode.h>
+
+#include "error.hh"
+
+namespace brotli {
+
+void compress_alloc(
+  const char* in, size_t in_size,
+  char*& out, size_t& out_size,
+  int quality
+) {
+  size_t size = ::BrotliEncoderMaxCompressedSize(in_size);
+  if (size == 0) ERROR("brotli: input too large");
+  out = reinterpret_cast<char*>(realloc(out,size));
+  if (!out) THROW_ERRNO("realloc()");
+  if (!::BrotliEncoderCompress(
+    quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC,
+    in_size, reinterpret_cast<const uint8_t*>(in),
+    &size, reinterpret_cast<uint8_t*>(out)
+  )) ERROR("BrotliEncoderCompress() failed");
+  out = reinterpret_cast<char*>(realloc(out,(out_size = size)));
+}
+
+}
@@ -2,109 +2,843 @@
 
 #include <iostream>
 #include <cstdlib>
-#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <deque>
+#include <list>
 #include <string>
 #include <thread>
-#include <shared_mutex>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+#include <openssl/sha.h>
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
+#include <dirent.h>
 
 #include "local_fd.hh"
+#include "scope_guard.hh"
+#include "task_pool.hh"
+#include "mmap_buf.hh"
+#include "rcu.hh"
 #include "zlib.hh"
+#include "brotli.hh"
+#include "zstd.hh"
 #include "error.hh"
 
 namespace ivanp {
 namespace {
 
 struct cached_file {
-  char *data = nullptr, *zdata = nullptr;
-  size_t size = 0, zsize = 0;
-  time_t time = 0;
+  const std::string name;
+  const mmap_buf data;
+  // compressed variants by encoding, each published once
+  std::atomic<const mmap_buf*> variants[n_encodings] { };
+  // complete responses by encoding, including identity
+  std::atomic<const mmap_buf*> responses[n_encodings] { };
+  std::atomic<uint8_t> freq = 0; // S3-FIFO access counter, saturates at 3
+  std::atomic<bool> stale = false; // the file changed, reload on next miss
+  std::atomic<uint8_t> queued = 0; // bit mask of encodings being built
+
+  // guarded by mx_writer
+  bool main = false; // in main or in small queue
+  size_t bytes = 0;
+
+  // content hash, keys the variant store
+  std::once_flag hashed;
+  char digest[SHA256_DIGEST_LENGTH*2];
 
+  cached_file(std::string_view name, mmap_buf&& data)
+  : name(name), data(std::move(data)), bytes(this->data.mapped()) { }
   ~cached_file() {
-    free( data); // ok to free nullptr
-    free(zdata);
+    for (auto& v : variants) delete v.load();
+    for (auto& r : responses) delete r.load();
+  }
+
+  const mmap_buf* variant(encoding e) const noexcept {
+    return variants[unsigned(e)].load(std::memory_order_acquire);
+  }
+
+  std::string_view hash() {
+    std::call_once(hashed,[this]{
+      unsigned char md[SHA256_DIGEST_LENGTH];
+      ::SHA256(reinterpret_cast<const unsigned char*>(data.data()),
+        data.size(), md);
+      for (unsigned i=0; i<SHA256_DIGEST_LENGTH; ++i) {
+        digest[i*2  ] = "0123456789abcdef"[md[i] >> 4];
+        digest[i*2+1] = "0123456789abcdef"[md[i] & 0xF];
+      }
+    });
+    return { digest, sizeof(digest) };
+  }
+
+  void hit() noexcept {
+    uint8_t f = freq.load(std::memory_order_relaxed);
+    if (f < 3) freq.store(f+1,std::memory_order_relaxed); // racy is ok
+  }
+};
+using entry_ptr = std::shared_ptr<cached_file>;
+
+// bounded FIFO set of name hashes
+class hash_fifo {
+  std::vector<size_t> ring;
+  std::unordered_multiset<size_t> set;
+  size_t next = 0;
+
+public:
+  hash_fifo(size_t n): ring(n) { }
+
+  bool contains(size_t h) const { return set.find(h) != set.end(); }
+  void insert(size_t h) {
+    size_t& old = ring[next];
+    if (set.size() == ring.size()) set.erase(set.find(old));
+    set.insert(old = h);
+    if (++next == ring.size()) next = 0;
+  }
+};
+
+struct string_hash {
+  using is_transparent = void;
+  size_t operator()(std::string_view s) const noexcept {
+    return std::hash<std::string_view>{}(s);
+  }
+};
+
+// entries whose names hash to the same slot, never modified once published
+using bucket = std::vector<entry_ptr>;
+
+struct table_t {
+  const size_t mask; // number of buckets - 1
+  const std::unique_ptr<std::atomic<const bucket*>[]> buckets;
+  size_t size = 0; // guarded by mx_writer
+
+  explicit table_t(size_t n)
+  : mask(n-1), buckets(new std::atomic<const bucket*>[n] { }) { }
+  ~table_t() { for (size_t i=0; i<=mask; ++i) delete buckets[i].load(); }
+
+  std::atomic<const bucket*>& slot(std::string_view key) const noexcept {
+    return buckets[string_hash{}(key) & mask];
+  }
+
+  template <typename F>
+  void for_each(F&& f) const {
+    for (size_t i=0; i<=mask; ++i)
+      if (const bucket* b = buckets[i].load(std::memory_order_acquire))
+        for (const entry_ptr& e : *b) f(e);
   }
 };
 
-std::map<std::string,cached_file> files;
-std::shared_mutex mx_file_cache;
+// readers find entries inside an rcu read section and take no lock,
+// writers are serialized by mx_writer and publish a modified copy
+// of the one bucket they change, the table is only copied to grow it
+std::atomic<const table_t*> table = new table_t(1 << 8);
+std::mutex mx_writer;
+
+entry_ptr find(std::string_view key) {
+  const bucket* const b = table.load(std::memory_order_acquire)
+    ->slot(key).load(std::memory_order_acquire);
+  if (b) for (const entry_ptr& f : *b) if (f->name == key) return f;
+  return nullptr;
+}
+
+// doubles the number of buckets
+void grow() {
+  const table_t* const old = table.load();
+  const size_t n = (old->mask+1)*2;
+  std::vector<bucket> next(n);
+  old->for_each([&](const entry_ptr& f){
+    next[string_hash{}(f->name) & (n-1)].push_back(f);
+  });
+  auto* const t = new table_t(n);
+  for (size_t i=0; i<n; ++i)
+    if (!next[i].empty()) t->buckets[i] = new bucket(std::move(next[i]));
+  t->size = old->size;
+  table.store(t,std::memory_order_release);
+  rcu::retire(old);
+}
+
+// replaces the entry named key with f, or removes it if f is null
+void publish(std::string_view key, entry_ptr f) {
+  table_t& t = const_cast<table_t&>(*table.load());
+  auto& slot = t.slot(key);
+  const bucket* const old = slot.load();
+  auto b = std::make_unique<bucket>();
+  if (old) {
+    b->reserve(old->size() + 1);
+    for (const entry_ptr& g : *old) if (g->name != key) b->push_back(g);
+    t.size -= old->size() - b->size();
+  }
+  if (f) {
+    b->push_back(std::move(f));
+    ++t.size;
+  }
+  slot.store(b->empty() ? nullptr : b.release(), std::memory_order_release);
+  if (old) rcu::retire(old);
+  if (t.size > t.mask+1) grow();
+}
+
+// S3-FIFO: new entries go into the small queue, entries accessed again
+// before reaching its head are promoted to the main queue,
+// the rest are evicted and remembered in the ghost queue
+std::deque<entry_ptr> small_q, main_q;
+size_t small_bytes = 0, total_bytes = 0;
+hash_fifo ghost(1 << 12);
+// admission: a name is cached on its second miss
+hash_fifo doorkeeper(1 << 12);
+
+std::atomic<size_t> n_hits, n_misses, n_evictions, n_rejected,
+                    n_invalidations, n_stale, n_loads, n_compressions,
+                    n_restored, n_fd_hits;
 
+void erase(const entry_ptr& f) {
+  total_bytes -= f->bytes;
+  if (!f->main) small_bytes -= f->bytes;
+  publish(f->name, nullptr);
 }
 
-locked_cache_view::~locked_cache_view() {
-  if (data) mx_file_cache.unlock_shared();
-  if (fd != -1) ::close(fd);
+bool evict_main(const cached_file* keep) {
+  // at most 3 rotations are needed to bring every counter down to 0
+  for (size_t n = main_q.size()*4; n; --n) {
+    entry_ptr f = std::move(main_q.front());
+    main_q.pop_front();
+    auto& freq = f->freq;
+    if (f.get() == keep || freq > 0) {
+      if (freq > 0) --freq;
+      main_q.push_back(std::move(f));
+    } else {
+      erase(f);
+      ++n_evictions;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool evict_small(const cached_file* keep) {
+  for (size_t n = small_q.size(); n; --n) {
+    entry_ptr f = std::move(small_q.front());
+    small_q.pop_front();
+    if (f.get() == keep) {
+      small_q.push_back(std::move(f));
+    } else if (f->freq > 1) {
+      small_bytes -= f->bytes;
+      f->main = true;
+      f->freq = 0;
+      main_q.push_back(std::move(f));
+    } else {
+      ghost.insert(std::hash<std::string_view>{}(f->name));
+      erase(f);
+      ++n_evictions;
+      return true;
+    }
+  }
+  return false;
 }
 
-locked_cache_view file_cache(const char* name, bool gz) {
-  const int fd = PCALLR(open)(name,O_RDONLY);
+// make room for extra bytes, never evicting keep
+void evict(size_t extra, const cached_file* keep) {
+  while (total_bytes + extra > file_cache_max_total) {
+    if (small_bytes >= file_cache_max_total/10 || main_q.empty()) {
+      if (evict_small(keep)) continue;
+      if (evict_main(keep)) continue;
+    } else {
+      if (evict_main(keep)) continue;
+      if (evict_small(keep)) continue;
+    }
+    break; // nothing left to evict
+  }
+}
+
+void account(cached_file& f, ptrdiff_t delta) {
+  f.bytes += delta;
+  total_bytes += delta;
+  if (!f.main) small_bytes += delta;
+}
+
+// single-flight: one thread loads a file at a time,
+// concurrent requests for it are served the stale entry or wait
+struct flight {
+  bool done = false;
+  bool dirty = false; // the file changed while loading
+};
+std::unordered_map<
+  std::string, std::shared_ptr<flight>, string_hash, std::equal_to<>
+> flights; // guarded by mx_writer
+std::condition_variable cv_flights;
+
+void insert(entry_ptr f, bool main) {
+  evict(f->bytes,nullptr);
+  total_bytes += f->bytes;
+  f->main = main;
+  if (main) {
+    main_q.push_back(f);
+  } else {
+    small_bytes += f->bytes;
+    small_q.push_back(f);
+  }
+  const std::string_view key = f->name;
+  publish(key, std::move(f));
+}
+
+// background compression -------------------------------------------
+task_pool& compress_pool() {
+  // never destroyed, the workers are detached
+  static task_pool& pool = *new task_pool(file_cache_compress_threads, 19);
+  return pool;
+}
+
+bool encodable(encoding e) noexcept {
+  return e != encoding::zstd || zstd::available;
+}
+
+// persistent variant store --------------------------------------------
+// encoder settings are part of the key, gzip is Z_BEST_COMPRESSION
+constexpr int brotli_quality = 11, zstd_level = 19;
+
+const char* encoder_tag(encoding e) noexcept {
+  switch (e) {
+    case encoding::gzip: return ".gz9";
+    case encoding::br  : return ".br11";
+    case encoding::zstd: return ".zst19";
+    default            : return "";
+  }
+}
+
+std::string store_path(cached_file& f, encoding e) {
+  return cat(file_cache_store,'/',f.hash(),encoder_tag(e));
+}
+
+// store files are only ever replaced by rename(), so mapping them is safe
+mmap_buf store_load(cached_file& f, encoding e) {
+  if (!file_cache_store || !*file_cache_store) return { };
+  const int fd = ::open(store_path(f,e).c_str(), O_RDONLY);
+  if (fd < 0) return { };
+  scope_guard close_fd([fd]{ ::close(fd); });
+  struct stat sb;
+  if (::fstat(fd,&sb) || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+    return { };
+  return mmap_buf::map(fd, sb.st_size);
+}
+
+void store_save(cached_file& f, encoding e, const char* data, size_t size) {
+  if (!file_cache_store || !*file_cache_store) return;
+  const std::string path = store_path(f,e);
+  std::string tmp = cat(path,".XXXXXX");
+  const int fd = PCALLR(mkstemp)(tmp.data());
+  bool ok = false;
+  scope_guard cleanup([&]{
+    ::close(fd);
+    if (!ok) ::unlink(tmp.c_str());
+  });
+  for (size_t n; size; data += n, size -= n)
+    n = PCALLR(write)(fd, data, size);
+  PCALL(fdatasync)(fd); // never rename a partially written file into place
+  PCALL(rename)(tmp.c_str(), path.c_str());
+  ok = true;
+}
+
+// marks the variant as being built, false if it already was
+bool queue(cached_file& f, encoding e) noexcept {
+  const uint8_t bit = 1 << unsigned(e);
+  return !(f.queued.fetch_or(bit) & bit);
+}
+
+// clears the mark of a failed build, so that it is retried
+void unqueue(cached_file& f, encoding e) noexcept {
+  f.queued.fetch_and(~(1u << unsigned(e)));
+}
+
+// builds or restores a variant and publishes it
+void build(const entry_ptr& f, encoding e) try {
+  auto z = std::make_unique<mmap_buf>(store_load(*f,e));
+  if (!*z) {
+    const char* const data = f->data.data();
+    const size_t size = f->data.size();
+    char* zdata = nullptr;
+    size_t zsize = 0;
+    scope_guard zfree([&]{ free(zdata); });
+    switch (e) {
+      case encoding::gzip:
+        if (size < file_cache_parallel_min)
+          zlib::deflate_alloc(data,size,zdata,zsize);
+        else zlib::deflate_parallel(data,size,zdata,zsize,
+          file_cache_compress_threads);
+        break;
+      case encoding::br:
+        brotli::compress_alloc(data,size,zdata,zsize,brotli_quality);
+        break;
+      case encoding::zstd:
+        zstd::compress_alloc(data,size,zdata,zsize,zstd_level);
+        break;
+      default: return;
+    }
+    *z = mmap_buf::copy(zdata,zsize);
+    ++n_compressions;
+    try {
+      store_save(*f,e,zdata,zsize);
+    } catch (const std::exception& err) { // the variant is still served
+      REDERR << err.what() << "\033[0m" << std::endl;
+    }
+  } else ++n_restored;
+
+  std::lock_guard lock(mx_writer);
+  if (f->stale || find(f->name) != f) return;
+  evict(z->mapped(),f.get());
+  account(*f, z->mapped());
+  f->variants[unsigned(e)].store(z.release(),std::memory_order_release);
+} catch (...) {
+  unqueue(*f,e);
+  throw;
+}
+
+void compress(const entry_ptr& f, encoding e) {
+  if (!queue(*f,e)) return;
   try {
-    struct stat sb;
-    PCALL(fstat)(fd,&sb);
-    if (!S_ISREG(sb.st_mode)) ERROR("not a regular file");
-
-    if (sb.st_size == 0) return { };
-
-retry_cached:
-    mx_file_cache.lock_shared();
-    auto& f = files[name];
-    const bool same_time = (sb.st_mtime == f.time);
-    if (same_time && (gz ? f.zdata : f.data))
-      goto return_cached;
-    mx_file_cache.unlock_shared();
-
-    if ((size_t)sb.st_size > file_cache_max_size)
-      return { nullptr, sb.st_size, false, fd };
-      // gz = false if too large to cache
-
-    if (!mx_file_cache.try_lock()) {
-      std::this_thread::yield();
-      goto retry_cached;
-    }
-
-    if (!same_time) {
-      f.time = sb.st_mtime;
-      free(f.data);
-      f.data = reinterpret_cast<char*>( malloc(f.size = sb.st_size) );
-      try {
-        PCALL(read)(fd, f.data, f.size);
-      } catch (...) {
-        mx_file_cache.unlock();
-        throw;
+    compress_pool().push([f,e]{ build(f,e); });
+  } catch (...) {
+    unqueue(*f,e);
+    throw;
+  }
+}
+
+// preassembles the response, once the file was accessed again
+const mmap_buf* respond(
+  const entry_ptr& f, encoding e, const mmap_buf& body,
+  const response_head& head
+) {
+  auto& slot = f->responses[unsigned(e)];
+  if (const mmap_buf* r = slot.load(std::memory_order_acquire)) return r;
+  if (f->freq.load(std::memory_order_relaxed) == 0 || f->stale
+    || body.size() > file_cache_response_max_size) return nullptr;
+
+  auto r = std::make_unique<const mmap_buf>(
+    mmap_buf::copy({ head(e,body.size()), body }));
+
+  std::lock_guard lock(mx_writer);
+  if (slot.load() || f->stale || find(f->name) != f)
+    return nullptr;
+  evict(r->mapped(),f.get());
+  account(*f, r->mapped());
+  slot.store(r.get(),std::memory_order_release);
+  return r.release();
+}
+
+// picks up name.gz, name.br and name.zst files not older than the file
+void load_precompressed(cached_file& f, const struct stat& sb) {
+  for (unsigned i=1; i<n_encodings; ++i) {
+    const std::string name = cat(f.name, encoding_suffix(encoding(i)));
+    const int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0) continue;
+    scope_guard close_fd([fd]{ ::close(fd); });
+    struct stat zsb;
+    if (::fstat(fd,&zsb) || !S_ISREG(zsb.st_mode) || zsb.st_size == 0
+      || zsb.st_mtim.tv_sec < sb.st_mtim.tv_sec
+      || (zsb.st_mtim.tv_sec == sb.st_mtim.tv_sec
+       && zsb.st_mtim.tv_nsec < sb.st_mtim.tv_nsec)) continue;
+    try {
+      const auto* z = new mmap_buf(file_cache_mmap
+        ? mmap_buf::map (fd, zsb.st_size)
+        : mmap_buf::read(fd, zsb.st_size));
+      f.variants[i] = z;
+      f.bytes += z->mapped();
+    } catch (const std::exception& e) { // being rewritten, build instead
+      REDERR << name << ": " << e.what() << "\033[0m" << std::endl;
+    }
+  }
+}
+
+// open files ----------------------------------------------------------
+struct open_file {
+  int fd;
+  struct stat sb;
+  ~open_file() { ::close(fd); }
+};
+using fd_ptr = std::shared_ptr<const open_file>;
+
+// LRU of open files of watched paths, the fds stay open while in use
+std::list<std::pair<std::string,fd_ptr>> fd_lru;
+std::unordered_map<
+  std::string_view, decltype(fd_lru)::iterator, string_hash, std::equal_to<>
+> fds; // keys point into fd_lru
+std::mutex mx_fds;
+
+fd_ptr fd_find(std::string_view key) {
+  std::lock_guard lock(mx_fds);
+  const auto it = fds.find(key);
+  if (it == fds.end()) return nullptr;
+  fd_lru.splice(fd_lru.begin(), fd_lru, it->second);
+  ++n_fd_hits;
+  return it->second->second;
+}
+
+void fd_insert(std::string_view key, const fd_ptr& f) {
+  std::lock_guard lock(mx_fds);
+  if (fds.contains(key)) return;
+  fd_lru.emplace_front(key, f);
+  fds.emplace(fd_lru.front().first, fd_lru.begin());
+  while (fds.size() > file_cache_max_fds) {
+    fds.erase(fd_lru.back().first);
+    fd_lru.pop_back();
+  }
+}
+
+template <typename F>
+void fd_erase_if(F&& match) {
+  std::vector<fd_ptr> closed; // closed after unlocking
+  std::lock_guard lock(mx_fds);
+  for (auto it = fd_lru.begin(); it != fd_lru.end(); ) {
+    if (match(std::string_view(it->first))) {
+      closed.push_back(std::move(it->second));
+      fds.erase(it->first);
+      it = fd_lru.erase(it);
+    } else ++it;
+  }
+}
+
+// change notifications ---------------------------------------------
+std::vector<std::string> watched_dirs; // set once before serving
+
+bool watched(std::string_view name) noexcept {
+  for (const auto& dir : watched_dirs)
+    if (name.size() > dir.size() && name.starts_with(dir)
+        && name[dir.size()] == '/') return true;
+  return false;
+}
+
+std::string normalize(const char* name) {
+  std::string s;
+  for (const char* p = name; *p; ++p)
+    if (!(*p == '/' && !s.empty() && s.back() == '/')) s += *p;
+  return s;
+}
+
+// entries are marked stale rather than dropped,
+// so they can be served while the new version is loaded
+void invalidate(std::string_view path, bool dir) {
+  // a precompressed file invalidates the file it was made from
+  std::string_view base = path;
+  if (!dir) for (unsigned i=1; i<n_encodings; ++i) {
+    const std::string_view suffix = encoding_suffix(encoding(i));
+    if (path.ends_with(suffix)) {
+      base.remove_suffix(suffix.size());
+      break;
+    }
+  }
+  const auto match = [=](std::string_view name){
+    return dir ? (path.empty() || (name.starts_with(path)
+      && name.size() > path.size() && name[path.size()] == '/'))
+      : name == path || name == base;
+  };
+  fd_erase_if(match);
+  std::lock_guard lock(mx_writer);
+  table.load()->for_each([&](const entry_ptr& f){
+    if (match(f->name) && !f->stale.exchange(true)) ++n_invalidations;
+  });
+  for (const auto& [name, fl] : flights)
+    if (match(name)) fl->dirty = true;
+}
+
+constexpr uint32_t watch_mask =
+  IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |
+  IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+void add_watch(
+  int ifd, const std::string& dir, std::unordered_map<int,std::string>& wds
+) {
+  const int wd = ::inotify_add_watch(ifd, dir.c_str(), watch_mask);
+  if (wd < 0) {
+    REDERR << "inotify_add_watch(" << dir << "): "
+           << std::strerror(errno) << "\033[0m" << std::endl;
+    return;
+  }
+  wds[wd] = dir;
+  if (DIR* d = ::opendir(dir.c_str())) {
+    while (const dirent* e = ::readdir(d)) {
+      if (e->d_type != DT_DIR || e->d_name[0] == '.') continue;
+      add_watch(ifd, cat(dir,'/',e->d_name), wds);
+    }
+    ::closedir(d);
+  }
+}
+
+[[noreturn]]
+void watch_loop(int ifd, std::unordered_map<int,std::string> wds) {
+  alignas(inotify_event) char buf[1 << 12];
+  for (;;) {
+    const auto n = ::read(ifd, buf, sizeof(buf));
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      REDERR << "inotify read(): " << std::strerror(errno)
+             << "\033[0m" << std::endl;
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      continue;
+    }
+    for (const char* p = buf; p < buf + n; ) {
+      const auto* e = reinterpret_cast<const inotify_event*>(p);
+      p += sizeof(inotify_event) + e->len;
+
+      if (e->mask & IN_Q_OVERFLOW) { // events were lost
+        invalidate({ }, true);
+        continue;
+      }
+      const auto it = wds.find(e->wd);
+      if (it == wds.end()) continue;
+      if (e->mask & IN_IGNORED) { // watch removed
+        wds.erase(it);
+        continue;
+      }
+      const std::string path =
+        e->len ? cat(it->second,'/',e->name) : it->second;
+      if (e->mask & (IN_ISDIR | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if (e->mask & (IN_CREATE | IN_MOVED_TO))
+          add_watch(ifd, path, wds);
+        invalidate(path, true);
+      } else {
+        invalidate(path, false);
       }
     }
+  }
+}
+
+}
+
+namespace {
+
+// warm bypasses admission and builds missing variants on this thread
+cache_view lookup(
+  const char* name, const encoding_list& accept,
+  const response_head* head, bool warm
+) {
+  std::string norm;
+  std::string_view key = name;
+  if (strstr(name,"//")) key = norm = normalize(name);
+
+  const auto view = [&](entry_ptr&& f, encoding e) -> cache_view {
+    const mmap_buf* const z = f->variant(e);
+    const mmap_buf& buf = z ? *z : f->data;
+    const mmap_buf* const r = head ? respond(f,e,buf,*head) : nullptr;
+    cache_view v { buf.data(), buf.size(), e, -1, std::move(f) };
+    if (r) v.response = *r;
+    return v;
+  };
+  const bool watch = watched(key);
+  struct stat sb;
+  fd_ptr of;
+  const auto open = [&]() -> int {
+    if (watch && (of = fd_find(key))) {
+      sb = of->sb;
+      return of->fd;
+    }
+    const int fd = PCALLR(open)(name,O_RDONLY);
+    try {
+      PCALL(fstat)(fd,&sb);
+      if (!S_ISREG(sb.st_mode)) ERROR("not a regular file");
+    } catch (...) {
+      ::close(fd);
+      throw;
+    }
+    if (sb.st_size == 0) {
+      ::close(fd);
+      return -1;
+    }
+    of = std::make_shared<const open_file>(fd,sb);
+    return fd;
+  };
+  // open files of watched paths are kept until they change
+  const auto uncached = [&](int fd) -> cache_view {
+    if (fd == -1) return { };
+    if (watch) fd_insert(key, of);
+    return { nullptr, size_t(sb.st_size), encoding::identity, fd, of };
+  };
+
+  if (!watch) {
+    ++n_misses;
+    return uncached(open());
+  }
 
-    free(f.zdata);
-    if (gz) {
-      try {
-        zlib::deflate_alloc(f.data,f.size,f.zdata,f.zsize);
-      } catch (const std::exception& e) {
-        REDERR << e.what() << std::endl;
-        gz = false;
-        f.zdata = nullptr;
-        f.zsize = 0;
+  entry_ptr f;
+  const auto hit = [&](bool publish = true){
+    if (warm && publish) for (const encoding e : accept)
+      if (!f->variant(e) && encodable(e) && queue(*f,e)) build(f,e);
+    // serve the most preferred variant that is ready,
+    // build the most preferred missing one
+    bool building = !publish;
+    for (const encoding e : accept) {
+      if (f->variant(e)) return view(std::move(f), e);
+      if (!building && encodable(e)) {
+        compress(f,e);
+        building = true;
       }
-    } else {
-      f.zdata = nullptr;
-      f.zsize = 0;
     }
+    return view(std::move(f), encoding::identity);
+  };
 
-    // TODO: correctly downgrade unique to shared lock
-    mx_file_cache.unlock();
-    mx_file_cache.lock_shared();
+  { rcu::read_guard rg; // hits make no syscalls and take no locks
+    f = find(key);
+  }
+  if (f && !f->stale) {
+    ++n_hits;
+    f->hit();
+    return hit();
+  }
 
-return_cached:
-    if (gz) return { f.zdata, f.zsize, true, fd };
-    else return { f.data, f.size, false, fd };
-  } catch (...) {
-    ::close(fd);
+  std::shared_ptr<flight> fl;
+  { std::unique_lock lock(mx_writer);
+    for (;;) {
+      f = find(key);
+      if (f && !f->stale) { // loaded while this thread waited
+        ++n_hits;
+        f->hit();
+        lock.unlock(); // warm builds variants in hit()
+        return hit();
+      }
+      const auto it = flights.find(key);
+      if (it == flights.end()) break;
+      if (f) { // being reloaded, serve the old version
+        ++n_stale;
+        lock.unlock();
+        return hit();
+      }
+      const auto other = it->second;
+      cv_flights.wait(lock, [&]{ return other->done; });
+    }
+    ++n_misses;
+    if (!f && !warm) {
+      const size_t h = std::hash<std::string_view>{}(key);
+      if (!ghost.contains(h) && !doorkeeper.contains(h)) {
+        doorkeeper.insert(h);
+        ++n_rejected;
+        lock.unlock();
+        return uncached(open());
+      }
+    }
+    fl = flights.emplace(key, std::make_shared<flight>()).first->second;
+  }
+  scope_guard land([&]{
+    { std::lock_guard lock(mx_writer);
+      flights.erase(flights.find(key));
+      fl->done = true;
+    }
+    cv_flights.notify_all();
+  });
+
+  // this thread is the only one loading this file
+  const entry_ptr old = std::move(f);
+  int fd;
+  try {
+    fd = open();
+  } catch (...) { // deleted or replaced by a directory
+    if (old) {
+      std::lock_guard lock(mx_writer);
+      if (find(key) == old) {
+        std::erase(old->main ? main_q : small_q, old);
+        erase(old);
+      }
+    }
     throw;
   }
+  if (fd == -1 || size_t(sb.st_size) > file_cache_max_size)
+    return uncached(fd);
+  { const fd_ptr close_fd = std::move(of);
+    f = std::make_shared<cached_file>(key, file_cache_mmap
+      ? mmap_buf::map (fd, sb.st_size)
+      : mmap_buf::read(fd, sb.st_size));
+    load_precompressed(*f, sb);
+    for (const encoding e : accept) { // restore variants from the store
+      if (f->variant(e)) continue;
+      mmap_buf z = store_load(*f,e);
+      if (!z) continue;
+      f->bytes += z.mapped();
+      f->variants[unsigned(e)] = new mmap_buf(std::move(z));
+      ++n_restored;
+    }
+    ++n_loads;
+  }
+
+  bool publish;
+  { std::lock_guard lock(mx_writer);
+    // if the file changed while loading, serve this version unpublished
+    if ((publish = !fl->dirty)) {
+      bool main;
+      if (old && find(key) == old) { // replace stale entry
+        main = old->main;
+        f->freq.store(old->freq);
+        std::erase(main ? main_q : small_q, old);
+        erase(old);
+      } else {
+        main = ghost.contains(std::hash<std::string_view>{}(key));
+      }
+      insert(f,main);
+    }
+  }
+  return hit(publish);
+}
+
+}
+
+cache_view file_cache(const char* name, const encoding_list& accept) {
+  return lookup(name, accept, nullptr, false);
+}
+
+cache_view file_cache(
+  const char* name, const encoding_list& accept, const response_head& head
+) {
+  return lookup(name, accept, &head, false);
+}
+
+void file_cache_warm(const char* name, const encoding_list& encodings) {
+  lookup(name, encodings, nullptr, true);
+}
+
+void file_cache_watch(std::initializer_list<const char*> dirs) {
+  if (!watched_dirs.empty()) ERROR("file_cache_watch() called twice");
+  if (file_cache_store && *file_cache_store) { // mkdir -p
+    std::string dir = file_cache_store;
+    for (size_t i = 1; i <= dir.size(); ++i) {
+      if (i < dir.size() && dir[i] != '/') continue;
+      const char c = dir[i];
+      dir[i] = '\0';
+      if (::mkdir(dir.c_str(), 0755) && errno != EEXIST)
+        THROW_ERRNO("mkdir(",dir,")");
+      dir[i] = c;
+    }
+  }
+  const int ifd = PCALLR(inotify_init1)(IN_CLOEXEC);
+  std::unordered_map<int,std::string> wds;
+  for (const char* dir : dirs) {
+    std::string_view d = dir;
+    while (d.size() > 1 && d.back() == '/') d.remove_suffix(1);
+    watched_dirs.emplace_back(d);
+    add_watch(ifd, watched_dirs.back(), wds);
+  }
+  std::thread(watch_loop, ifd, std::move(wds)).detach();
+}
+
+file_cache_stats get_file_cache_stats() noexcept {
+  std::lock_guard lock(mx_writer);
+  return {
+    .hits = n_hits,
+    .misses = n_misses,
+    .evictions = n_evictions,
+    .rejected = n_rejected,
+    .invalidations = n_invalidations,
+    .stale = n_stale,
+    .loads = n_loads,
+    .compressions = n_compressions,
+    .restored = n_restored,
+    .fd_hits = n_fd_hits,
+    .entries = table.load()->size,
+    .bytes = total_bytes,
+    .fds = [&]{ std::lock_guard lock(mx_fds); return fds.size(); }()
+  };
 }
-// TODO: free old files
 
 } // end namespace ivanp
@@ -0,0 +1,83 @@
+#include "mmap_buf.hh"
+
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "error.hh"
+
+namespace ivanp {
+namespace {
+
+size_t page_size = ::sysconf(_SC_PAGESIZE);
+
+size_t page_ceil(size_t size) noexcept {
+  return (size + page_size - 1) & ~(page_size - 1);
+}
+
+void* map_anon(size_t size) {
+  void* const addr = ::mmap(
+    nullptr, size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) THROW_ERRNO("mmap()");
+  if (size >= mmap_hugepage_min_size)
+    ::madvise(addr, size, MADV_HUGEPAGE); // advisory, ok to fail
+  return addr;
+}
+
+}
+
+void mmap_region::release() noexcept {
+  if (refs.fetch_sub(1,std::memory_order_acq_rel) == 1) {
+    ::munmap(addr,size);
+    delete this;
+  }
+}
+
+mmap_buf mmap_buf::map(int fd, size_t size) {
+  if (size == 0) return { }; // mmap() of length 0 is EINVAL
+  void* const addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) THROW_ERRNO("mmap()");
+  // file-backed THP needs CONFIG_READ_ONLY_THP_FOR_FS, ok to fail
+  if (size >= mmap_hugepage_min_size)
+    ::madvise(addr, size, MADV_HUGEPAGE);
+  return {
+    static_cast<const char*>(addr), size,
+    new mmap_region(addr,page_ceil(size)) };
+}
+
+mmap_buf mmap_buf::read(int fd, size_t size) {
+  if (size == 0) return { };
+  const size_t cap = page_ceil(size);
+  char* const addr = static_cast<char*>(map_anon(cap));
+  auto* const r = new mmap_region(addr,cap);
+  mmap_buf buf(addr, size, r); // unmaps on throw
+  for (size_t nread = 0; nread < size; ) {
+    const auto ret = ::pread(fd, addr+nread, size-nread, nread);
+    if (ret < 0) THROW_ERRNO("pread()");
+    if (ret == 0) ERROR("file shrank while reading");
+    nread += ret;
+  }
+  PCALL(mprotect)(addr, cap, PROT_READ);
+  return buf;
+}
+
+mmap_buf mmap_buf::copy(std::initializer_list<std::string_view> parts) {
+  size_t size = 0;
+  for (const auto& p : parts) size += p.size();
+  if (size == 0) return { };
+
+  const size_t cap = page_ceil(size);
+  char* const addr = static_cast<char*>(map_anon(cap));
+  mmap_buf buf(addr, size, new mmap_region(addr,cap));
+  char* p = addr;
+  for (const auto& part : parts) {
+    ::memcpy(p, part.data(), part.size());
+    p += part.size();
+  }
+  PCALL(mprotect)(addr, cap, PROT_READ);
+  return buf;
+}
+
+} // end namespace ivanp
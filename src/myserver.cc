@@ -2,11 +2,19 @@
 #include <fstream>
 #include <mutex>
 #include <shared_mutex>
+#include <unordered_map>
+#include <memory>
 
-#include "whole_file.hh"
+#include <csignal>
+
+#include "file_cache.hh"
 #include "server/server.hh"
 #include "server/http.hh"
+#include "server/assets.hh"
+#include "server/page_template.hh"
 #include "server/websocket.hh"
+#include "server/pubsub.hh"
+#include "server/heartbeat.hh"
 #include "server/users.hh"
 #include "error.hh"
 #include "debug.hh"
@@ -37,22 +45,74 @@ std::string pw_login(const char* name, const char* pw) {
   else return { };
 }
 
+// only used by the worker that owns the socket, except for sends
+using ws_connection = websocket::connection;
+std::mutex mx_ws;
+std::unordered_map<int,std::shared_ptr<ws_connection>> ws_connections;
+
+std::shared_ptr<ws_connection> find_ws(int fd) {
+  std::lock_guard lock(mx_ws);
+  const auto it = ws_connections.find(fd);
+  if (it == ws_connections.end()) return { };
+  return it->second;
+}
+std::shared_ptr<ws_connection> take_ws(int fd) {
+  std::lock_guard lock(mx_ws);
+  const auto it = ws_connections.find(fd);
+  if (it == ws_connections.end()) return { };
+  auto ws = std::move(it->second);
+  ws_connections.erase(it);
+  return ws;
+}
+
 int main(int argc, char* argv[]) {
   const server::port_t server_port = 8080;
   const unsigned nthreads = std::thread::hardware_concurrency();
   const unsigned epoll_nevents = 64;
   const size_t thread_buffer_size = 1<<13;
 
+  // writes to peers that went away fail with EPIPE instead
+  std::signal(SIGPIPE, SIG_IGN);
+
+  file_cache_watch({"files","pages","config"});
+
+  // only files known at startup are served
+  const http::asset_manifest assets({
+    { "/", "pages/index.html" },
+    { "/", "files" },
+    { nullptr, "pages" }
+  });
+  assets.warm();
+  cout << assets.size() << " assets" << std::endl;
+  const http::page_template index_user("pages/index_user.html");
+
   server server(server_port,epoll_nevents);
   cout << "Listening on port " << server_port <<'\n'<< std::endl;
 
+  // broadcasts to members owned by other workers go through mailboxes
+  websocket::pubsub chat(nthreads, [&](unsigned w){ server.wake(w); });
+  // no need to manually remove from epoll
+  const auto close_ws = [&](socket sock){
+    if (const auto ws = take_ws(sock)) {
+      chat.leave(ws.get());
+      server.unpin(sock);
+      ws->close();
+    } else sock.close();
+  };
+  // pings every 30 s, hangs up on peers that don't answer within 10 s
+  websocket::heartbeat heartbeat(std::chrono::seconds(1), 30, 10);
+
   server(nthreads, thread_buffer_size,
-  [](auto& server, file_desc sock, auto& buffer){
+  [&](auto& server, file_desc sock, auto& buffer){
+    if (sock == -1) { // woken for posted messages
+      chat.drain(server.worker());
+      return;
+    }
     // HTTP *********************************************************
     if (server.accept(sock)) { try {
       INFO("35;1","HTTP");
       http::request req(sock, buffer.data(), buffer.size(), 1<<20);
-      if (!req.method) return;
+      if (!req.method) { sock.close(); return; } // peer hung up
       const auto g = req.get_params();
 
 #ifndef NDEBUG
@@ -71,49 +131,33 @@ int main(int argc, char* argv[]) {
         if (*path=='\0') { // serve index page ----------------------
           const auto user = cookie_login(req);
           if (user.empty()) { // not logged in
-            http::send_file(sock,"pages/index.html");
+            http::send_file(sock,*assets["/"],http::accept_encoding(req));
           } else { // logged in
             TEST(user)
-            auto page = whole_file("pages/index_user.html");
-            { static constexpr char token[] = "<!-- GLOBAL_VARS_JS -->";
-              page.replace(page.find(token),sizeof(token)-1,cat(
-                "\nconst user = \"",user,"\";\n"
-              ));
-            }
-            { static constexpr char token[] = "<!-- USER_NAME -->";
-              page.replace(page.find(token),sizeof(token)-1,user);
-            }
-            sock <<
-              (http::header("text/html; charset=UTF-8",page.size()) + page);
+            index_user.send(sock, {{ "user", user }},
+              http::accept_encoding(req));
           }
         } else if (!strcmp(path,"chat")) { // initiate websocket ----
           // const auto user = cookie_login(req); // require login
-          websocket::handshake(sock, req);
-          server.epoll_add(std::move(sock)); // move prevents closing
-        } else { // serve any allowed file --------------------------
-          // disallow arbitrary path
-          for (const char* p=path; ; ++p) {
-            if (const char c = *p) {
-              // allow only - . / _ 09 AZ az
-              if (!( ('-'<=c && c<='9') || ('A'<=c && c<='Z')
-                  || c=='_' || ('a'<=c && c<='z') )) {
-                HTTP_ERROR(403,
-                  "path \"",path,"\" contains a disallowed character "
-                  "\'",c,"\'");
-              } else
-              // disallow ..
-              if (c=='.' && (p==path || *(p-1)=='/')) {
-                while (*++p=='.') { }
-                if (*p=='/' || *p=='\0') {
-                  HTTP_ERROR(403,
-                    "path \"",path,"\" contains a disallowed sequence \"",
-                    std::string_view((p==path ? p : p-1),(*p ? p+1 : p)),"\"");
-                } else --p;
-              }
-            } else break;
+          websocket::deflate_params deflate;
+          const auto response = websocket::handshake(req, deflate);
+          const auto ws = std::make_shared<ws_connection>(sock, deflate);
+          server.pin(sock); // later events go to server.owner(sock)
+          { std::lock_guard lock(mx_ws);
+            ws_connections[sock] = ws;
           }
-          // serve a file
-          http::send_file(sock,cat("files/",path));
+          chat.join("chat", ws, server.owner(sock));
+          heartbeat.add(ws);
+          server.watch_writable(sock);
+          INFO("35;1","New websocket ",std::to_string(sock));
+          // only once registered, the client's first frame may follow it
+          // if this fails, the owner sees the hangup and unregisters it
+          try { sock << response; } catch (...) { ws->shutdown(); }
+          sock = -1; // keeps it open
+        } else { // serve a file from the manifest ------------------
+          const http::asset* a = assets[g.path()];
+          if (!a) HTTP_ERROR(404,"no asset \"",g.path(),'\"');
+          http::send_file(sock,*a,http::accept_encoding(req));
         }
       } else if (!strcmp(req.method,"POST")) { // ===================
         if (!strcmp(path,"login")) {
@@ -167,14 +211,19 @@ int main(int argc, char* argv[]) {
     // WebSocket ****************************************************
     } else { try {
       INFO("35;1","WebSocket")
-      auto frame = websocket::receive_frame(sock,buffer.data(),buffer.size());
-      if (!frame.data()) return;
-      TEST(frame)
-      websocket::send_frame(sock,buffer.data(),buffer.size(),
-        "TEST");
+      const auto ws = find_ws(sock);
+      if (!ws) return; // event of a closed connection, the fd isn't ours
+      ws->flush(); // woken by EPOLLOUT
+      if (!ws->receive(buffer.data(),buffer.size(),
+        [&](const websocket::frame& frame){
+          TEST(frame)
+          chat.publish("chat", frame.payload, frame.opcode,
+            server.worker());
+        }
+      )) close_ws(sock);
     } catch (...) {
       // TODO: send response
-      sock.close(); // no need to manually remove from epoll
+      close_ws(sock);
       throw;
     }
     }
@@ -0,0 +1,83 @@
+#include "rcu.hh"
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <limits>
+
+namespace ivanp::rcu {
+namespace {
+
+std::atomic<uint64_t> global_epoch = 1;
+
+struct reader {
+  std::atomic<uint64_t> epoch = 0; // 0 when not in a read section
+  std::atomic<bool> used = true;
+  unsigned nest = 0;
+  reader* next = nullptr;
+};
+// records are never freed, exited threads leave theirs for reuse
+std::atomic<reader*> readers = nullptr;
+
+struct thread_reader {
+  reader* r;
+
+  thread_reader() {
+    for (r = readers.load(); r; r = r->next) {
+      bool used = false;
+      if (r->used.compare_exchange_strong(used,true)) return;
+    }
+    r = new reader;
+    r->next = readers.load();
+    while (!readers.compare_exchange_weak(r->next,r)) { }
+  }
+  ~thread_reader() { r->used = false; }
+};
+thread_local thread_reader self;
+
+struct retired {
+  void* p;
+  void(*del)(void*);
+  uint64_t epoch;
+};
+std::vector<retired> garbage;
+std::mutex mx_garbage;
+
+}
+
+void read_lock() noexcept {
+  reader* const r = self.r;
+  if (r->nest++ == 0) r->epoch = global_epoch.load();
+}
+
+void read_unlock() noexcept {
+  reader* const r = self.r;
+  if (--r->nest == 0) r->epoch.store(0,std::memory_order_release);
+}
+
+void retire(void* p, void(*del)(void*)) {
+  const uint64_t epoch = global_epoch.fetch_add(1);
+
+  std::vector<retired> free;
+  { std::lock_guard lock(mx_garbage);
+    garbage.push_back({p,del,epoch});
+
+    uint64_t min = std::numeric_limits<uint64_t>::max();
+    for (reader* r = readers.load(); r; r = r->next) {
+      const uint64_t e = r->epoch.load();
+      if (e && e < min) min = e;
+    }
+
+    // readers that started after an object was retired can't see it
+    std::erase_if(garbage, [&](const retired& g){
+      if (g.epoch < min) {
+        free.push_back(g);
+        return true;
+      } else return false;
+    });
+  }
+  for (const auto& g : free) g.del(g.p);
+}
+
+} // end namespace ivanp::rcu
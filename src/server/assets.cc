@@ -0,0 +1,90 @@
+#include "server/assets.hh"
+
+#include <iostream>
+#include <unordered_set>
+#include <atomic>
+#include <thread>
+
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "server/http.hh"
+#include "file_cache.hh"
+#include "scope_guard.hh"
+#include "error.hh"
+
+namespace ivanp::http {
+namespace {
+
+asset make_asset(std::string name) {
+  const auto [mime, compressible] = get_file_type(name.c_str());
+  return { std::move(name), mime, compressible };
+}
+
+// hidden files are skipped, symbolic links to directories are not followed
+template <typename F>
+void scan(const std::string& dir, const std::string& rel, F&& f) {
+  DIR* const d = ::opendir(dir.c_str());
+  if (!d) THROW_ERRNO("opendir(",dir,")");
+  scope_guard close_dir([d]{ ::closedir(d); });
+  while (const dirent* e = ::readdir(d)) {
+    if (e->d_name[0] == '.') continue;
+    const std::string path = cat(dir,'/',e->d_name);
+    struct stat sb;
+    if (::lstat(path.c_str(),&sb)) continue;
+    if (S_ISDIR(sb.st_mode)) {
+      scan(path, cat(rel,e->d_name,'/'), f);
+      continue;
+    }
+    if (S_ISLNK(sb.st_mode) && ::stat(path.c_str(),&sb)) continue;
+    if (S_ISREG(sb.st_mode)) f(path, cat(rel,e->d_name));
+  }
+}
+
+}
+
+asset_manifest::asset_manifest(std::initializer_list<mount> mounts) {
+  for (const auto& [url, path] : mounts) {
+    struct stat sb;
+    PCALL(stat)(path,&sb);
+    const auto add = [&](const std::string& name, const std::string& rel){
+      if (url) assets.try_emplace(cat(url,rel), make_asset(name));
+      else unlisted.push_back(make_asset(name));
+    };
+    if (S_ISDIR(sb.st_mode)) {
+      std::string dir = path;
+      while (dir.size() > 1 && dir.back() == '/') dir.pop_back();
+      scan(dir, { }, add);
+    } else add(path, { });
+  }
+}
+
+void asset_manifest::warm(unsigned nthreads) const {
+  std::vector<const asset*> all;
+  { std::unordered_set<std::string_view> names;
+    for (const auto& [url, a] : assets)
+      if (names.insert(a.name).second) all.push_back(&a);
+    for (const auto& a : unlisted)
+      if (names.insert(a.name).second) all.push_back(&a);
+  }
+
+  if (nthreads == 0) nthreads = std::thread::hardware_concurrency();
+  std::atomic<size_t> next = 0;
+  const auto worker = [&]{
+    for (size_t i; (i = next++) < all.size(); ) {
+      const asset& a = *all[i];
+      try {
+        file_cache_warm(a.name.c_str(), a.compressible
+          ? encoding_list{ encoding::br, encoding::zstd, encoding::gzip }
+          : encoding_list{ });
+      } catch (const std::exception& e) {
+        REDERR << a.name << ": " << e.what() << "\033[0m" << std::endl;
+      }
+    }
+  };
+  std::vector<std::jthread> threads;
+  threads.reserve(nthreads);
+  for (unsigned i=0; i<nthreads; ++i) threads.emplace_back(worker);
+}
+
+}
@@ -0,0 +1,63 @@
+#include "server/heartbeat.hh"
+
+#include <algorithm>
+#include <iostream>
+
+namespace ivanp::websocket {
+
+heartbeat::heartbeat(
+  std::chrono::milliseconds tick, unsigned interval, unsigned timeout
+): wheel(std::max({interval,timeout,1u})+1),
+   interval(std::max(interval,1u)), timeout(std::max(timeout,1u)),
+   thread([this,tick](std::stop_token stop){ run(stop,tick); })
+{ }
+
+void heartbeat::add(std::shared_ptr<connection> c) {
+  std::lock_guard lock(mx);
+  // staggered, so that a burst of connections isn't pinged all at once
+  wheel[(pos + 1 + added++ % interval) % wheel.size()].push_back(c);
+}
+
+size_t heartbeat::size() {
+  std::lock_guard lock(mx);
+  size_t n = 0;
+  for (const auto& slot : wheel) n += slot.size();
+  return n;
+}
+
+void heartbeat::run(std::stop_token stop, std::chrono::milliseconds tick) {
+  std::vector<std::weak_ptr<connection>> due;
+  std::vector<std::pair<std::weak_ptr<connection>,unsigned>> next;
+  auto t = std::chrono::steady_clock::now();
+  for (;;) {
+    { std::unique_lock lock(mx);
+      cv.wait_until(lock,stop,t += tick,[]{ return false; });
+      if (stop.stop_requested()) break;
+      pos = (pos + 1) % wheel.size();
+      due.swap(wheel[pos]);
+    }
+
+    // connections are ticked without holding the wheel
+    for (auto& w : due) {
+      const auto c = w.lock();
+      if (!c) continue;
+      try {
+        if (const unsigned n = c->tick(interval,timeout))
+          next.emplace_back(std::move(w),n);
+      } catch (const std::exception& e) { // a failed write
+        std::cerr << "\033[31m" << e.what() << "\033[0m" << std::endl;
+        c->shutdown();
+      }
+    }
+    due.clear();
+
+    if (!next.empty()) {
+      std::lock_guard lock(mx);
+      for (auto& [w, n] : next)
+        wheel[(pos + n) % wheel.size()].push_back(std::move(w));
+      next.clear();
+    }
+  }
+}
+
+}
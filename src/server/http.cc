@@ -3,10 +3,15 @@
 #include <vector>
 #include <algorithm>
 
+#include <sys/uio.h>
+
 #include "server/socket.hh"
+#include "server/assets.hh"
 #include "local_fd.hh"
 #include "whole_file.hh"
 #include "file_cache.hh"
+#include "mmap_buf.hh"
+#include "scope_guard.hh"
 #include "zlib.hh"
 #include "error.hh"
 #include "debug.hh"
@@ -33,7 +38,7 @@ struct mimes_dict {
       b = a + strcspn(a," \t\r\n"); // end of key
       if (strchr("\r\n",*b)) ERROR(filename); // no value
       *b = '\0';
-      const char* v1 = ++b;
+      char* v1 = ++b;
       b += strspn(b," \t"); // trim blanks before value
       if (strchr("\r\n",*b)) ERROR(filename); // no value
       const char* v2 = b;
@@ -52,11 +57,11 @@ struct mimes_dict {
 
 }
 
-const char* mimes(const char* ext) const noexcept {
+const char* mimes(const char* ext) noexcept {
   const auto end = mimes_dict.m.end();
-  const auto it = std::lower_bound(mimes_dict.m.begin(),end,chars_less{});
+  const auto it = std::lower_bound(mimes_dict.m.begin(),end,ext,chars_less{});
   if (it==end || chars_less{}(ext,*it)) return nullptr;
-  return *it;
+  return *it + strlen(*it) + 1; // value follows the key
 }
 
 const std::map<int,const char*> status_codes {
@@ -81,6 +86,91 @@ std::string header(
     more, "\r\n");
 }
 
+std::string chunked_header(std::string_view mime, std::string_view more) {
+  return cat(
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: ", mime, "\r\n"
+    "Transfer-Encoding: chunked\r\n",
+    more, "\r\n");
+}
+
+namespace {
+
+// room for the hex chunk size and line breaks around the data
+constexpr size_t chunk_pre = 8+2, chunk_post = 2+5;
+
+struct chunk_buffer {
+  size_t size = 0;
+  char* m = nullptr;
+
+  char* get(size_t n) {
+    n += chunk_pre + chunk_post;
+    if (size < n) {
+      free(m);
+      m = static_cast<char*>(malloc(size = n));
+      if (!m) throw std::bad_alloc();
+    }
+    return m;
+  }
+  ~chunk_buffer() { free(m); }
+};
+thread_local chunk_buffer chunk_buf;
+
+}
+
+gzip_chunked::gzip_chunked(socket sock, std::string header)
+: sock(sock), header(std::move(header)),
+  buf(chunk_buf.get(chunk_size) + chunk_pre), out(buf)
+{
+  zlib::deflate_stream::local().reset();
+}
+
+void gzip_chunked::flush(bool last) {
+  char *a = buf, *b = out;
+  if (size_t n = out - buf) {
+    *--a = '\n'; *--a = '\r';
+    do *--a = "0123456789abcdef"[n & 0xF]; while (n >>= 4);
+    *b++ = '\r'; *b++ = '\n';
+  }
+  if (last) b = std::copy_n("0\r\n\r\n", 5, b);
+  out = buf;
+  if (header.empty()) {
+    sock.write(a, b-a);
+  } else { // send header with the first chunk
+    iovec iov[2] {
+      { header.data(), header.size() },
+      { a, size_t(b-a) }
+    };
+    sock.write(iov, 2);
+    header.clear();
+  }
+}
+
+void gzip_chunked::write(std::string_view s) {
+  auto& zs = zlib::deflate_stream::local();
+  const char* in = s.data();
+  size_t in_size = s.size();
+  while (in_size) {
+    size_t avail = chunk_size - (out - buf);
+    zs(in, in_size, out, avail);
+    if (!avail) flush();
+  }
+}
+
+void gzip_chunked::finish() {
+  if (done) return;
+  auto& zs = zlib::deflate_stream::local();
+  const char* in = nullptr;
+  size_t in_size = 0;
+  for (;;) {
+    size_t avail = chunk_size - (out - buf);
+    if (zs(in, in_size, out, avail, true)) break;
+    if (!avail) flush();
+  }
+  flush(true);
+  done = true;
+}
+
 request::request(
   const socket sock, char* buffer, size_t size
 ) {
@@ -246,62 +336,108 @@ form_data::form_data(std::string_view str, bool q) noexcept: mem(str) {
   }
 }
 
-size_t read_buffer_size = 1 << 24;
+namespace {
+
+std::string encoding_header(encoding enc, bool vary) {
+  return cat(
+    enc != encoding::identity
+      ? cat("Content-Encoding: ",encoding_name(enc),"\r\n") : "",
+    vary ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+}
 
-void send_file(socket sock, const char* name, bool gz) {
-  const char *ext = strrchr(name,'.'),
-             *mime = "text/plain; charset=UTF-8";
-  gz = gz && [ext](const auto*... x){
-    return ( strcmp(ext,x) && ... );
-  }("jpg","png","webp","gif");
+encoding_list accept_encoding(const request& req) {
+  std::array<std::pair<float,encoding>,3> q {{
+    { req.qvalue("Accept-Encoding","br"  ), encoding::br   },
+    { req.qvalue("Accept-Encoding","zstd"), encoding::zstd },
+    { req.qvalue("Accept-Encoding","gzip"), encoding::gzip }
+  }};
+  // ties are broken by the order above, smallest output first
+  std::stable_sort(q.begin(), q.end(),
+    [](const auto& a, const auto& b){ return a.first > b.first; });
+  encoding_list list;
+  for (const auto& [v,e] : q) if (v > 0) list.push_back(e);
+  return list;
+}
+
+file_type get_file_type(const char* name) noexcept {
+  const char* const ext = strrchr(name,'.');
+  const char* mime = ext ? mimes(ext+1) : nullptr;
+  if (!mime) mime = "text/plain; charset=UTF-8";
+  // already compressed formats
+  const bool compressible = !ext || [ext](const auto*... x){
+    return ( strcmp(ext+1,x) && ... );
+  }("jpg","png","webp","gif","gz","br","zst");
+  return { mime, compressible };
+}
+
+void send_file(socket sock, const char* name, const encoding_list& accept) {
+  const auto [mime, compressible] = get_file_type(name);
+  send_file(sock, name, mime, compressible, accept);
+}
+
+void send_file(socket sock, const asset& a, const encoding_list& accept) {
+  send_file(sock, a.name.c_str(), a.mime, a.compressible, accept);
+}
+
+void send_file(
+  socket sock, const char* name, const char* mime, bool vary,
+  const encoding_list& accept
+) {
+  const encoding_list none { };
+  const encoding_list& acc = vary ? accept : none;
   try {
-    const auto cf = file_cache(name,gz);
-    const auto header = http::header(mime, cf.size,
-      cf.gz ? "Content-Encoding: gzip\r\n" : ""),
-    if (cf.data || !cf.size) { // send cached file
-      sock << cat(header,cf);
-    } else { // read and send
-      char* const buf = malloc(read_buffer_size);
+    const auto cf = file_cache(name, acc, [=](encoding enc, size_t size){
+      return http::header(mime, size, encoding_header(enc, vary));
+    });
+    if (!cf.response.empty()) { // one write of the preassembled response
+      sock.write(cf.response);
+    } else if (cf.data || !cf.size) { // send cached file
+      sock << cat(http::header(mime, cf.size,
+        encoding_header(cf.enc, vary)), cf);
+    } else if (cf.size >= gzip_chunked::min_size
+      && acc.contains(encoding::gzip)) { // compress while reading
+      gzip_chunked z(sock, chunked_header(mime,
+        encoding_header(encoding::gzip, vary)));
+      char* const buf = static_cast<char*>(malloc(gzip_chunked::chunk_size));
       scope_guard buffer_free([buf]{ free(buf); });
-      gz = false; // TODO: gzip
-      if (gz) {
-      } else {
-        // TODO: try again with sendfile()
-        // https://stackoverflow.com/q/1936037/2640636
-        size_t unread = cf.size;
-        memcpy(buf,header.data(),header.size());
-        size_t nread = PCALLR(read)(cf.fd, buf+header.size(),
-          std::min(unread,read_buffer_size-header.size()));
-        unread -= nread;
-        sock.write(buf,header.size()+nread);
-        while (unread) {
-          nread = PCALLR(read)(cf.fd, buf, std::min(unread,read_buffer_size));
-          unread -= nread;
-          sock.write(buf,nread);
-        }
+      // the fd is shared, don't move its offset
+      for (size_t off = 0; off < cf.size; ) {
+        const size_t nread = PCALLR(pread)(cf.fd, buf,
+          std::min(cf.size-off,gzip_chunked::chunk_size), off);
+        if (nread == 0) break; // file shrank, send what was read
+        off += nread;
+        z.write({ buf, nread });
       }
+      z.finish();
+    } else { // send from the cached fd
+      sock << http::header(mime, cf.size,
+        encoding_header(encoding::identity, vary));
+      sock.sendfile(cf.fd, 0, cf.size);
     }
   } catch (const std::exception& e) {
     HTTP_ERROR(404,"file ",name,":\n",e.what());
   }
 }
 
-void send_str( // TODO: rework
-  socket s, std::string_view str, std::string_view mime, bool gz
+void send_str(
+  socket sock, std::string_view str, std::string_view ext,
+  const encoding_list& accept
 ) {
-  if (!mime.empty()) {
-    const auto it = mimes.find(mime);
-    if (it != mimes.end()) mime = it->second;
-    else mime = "text/plain; charset=UTF-8";
-  } else mime = "text/plain; charset=UTF-8";
-
-  if (gzok) {
-    const auto gz = zlib::deflate_s(str);
-    s << cat(
-      http::header(mime,gz.size(),"Content-Encoding: gzip\r\n"),
-      std::string_view(gz.data(),gz.size()) );
+  const char* mime = nullptr;
+  if (!ext.empty()) mime = mimes(std::string(ext).c_str());
+  if (!mime) mime = "text/plain; charset=UTF-8";
+
+  if (str.size() >= gzip_chunked::min_size
+    && accept.contains(encoding::gzip)) {
+    gzip_chunked z(sock, chunked_header(mime,
+      encoding_header(encoding::gzip, true)));
+    z.write(str);
+    z.finish();
   } else {
-    s << cat(http::header(mime,str.size()), str);
+    sock << cat(http::header(mime, str.size(),
+      encoding_header(encoding::identity, true)), str);
   }
 }
 
@@ -0,0 +1,243 @@
+#include "server/page_template.hh"
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <array>
+
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "server/http.hh"
+#include "file_cache.hh"
+#include "zlib.hh"
+#include "scope_guard.hh"
+#include "error.hh"
+
+namespace ivanp::http {
+namespace {
+
+enum class slot_type { html, js, raw };
+
+std::string escape(std::string_view s, slot_type type) {
+  std::string out;
+  out.reserve(s.size() + s.size()/8);
+  const auto hex = [&](const char* pref, unsigned c, int n){
+    out += pref;
+    for (int i=n-1; i>=0; --i) out += "0123456789ABCDEF"[(c >> (4*i)) & 0xF];
+  };
+  for (size_t i=0; i<s.size(); ++i) {
+    const char c = s[i];
+    if (type == slot_type::html) switch (c) {
+      case '&': out += "&amp;" ; break;
+      case '<': out += "&lt;"  ; break;
+      case '>': out += "&gt;"  ; break;
+      case '"': out += "&quot;"; break;
+      case '\'': out += "&#39;"; break;
+      default: out += c;
+    } else switch (c) { // can't end the string or the script element
+      case '\\': out += "\\\\"; break;
+      case '"' : out += "\\\""; break;
+      case '\'': out += "\\'" ; break;
+      case '\n': out += "\\n" ; break;
+      case '\r': out += "\\r" ; break;
+      case '<': case '>': case '&': hex("\\x",c,2); break;
+      default:
+        if (uint8_t(c) < 0x20) hex("\\x",c,2);
+        else if (c == '\xE2' && i+2 < s.size() && s[i+1] == '\x80'
+          && (s[i+2] == '\xA8' || s[i+2] == '\xA9')) { // line separators
+          hex("\\u", s[i+2] == '\xA8' ? 0x2028 : 0x2029, 4);
+          i += 2;
+        } else out += c;
+    }
+  }
+  return out;
+}
+
+bool needs_escape(std::string_view s, slot_type type) noexcept {
+  if (type == slot_type::raw) return false;
+  const char* chars = type == slot_type::html
+    ? "&<>\"'" : "\\\"'\n\r<>&\xE2";
+  for (const char c : s)
+    if (strchr(chars,c) || (type == slot_type::js && uint8_t(c) < 0x20))
+      return true;
+  return false;
+}
+
+}
+
+struct page_template::compiled {
+  std::shared_ptr<const void> entry; // cache entry of the source
+  std::string own; // source, if it isn't in the cache
+  std::vector<std::string_view> fragments; // one more than slots
+  struct slot {
+    std::string_view name;
+    slot_type type;
+  };
+  std::vector<slot> slots;
+  size_t static_size = 0;
+
+  // raw deflate of each fragment, ending with a sync flush
+  struct zfragment {
+    std::string z;
+    unsigned long crc;
+  };
+  std::vector<zfragment> zfragments;
+  size_t static_zsize = 0;
+
+  compiled(cache_view&& cv): entry(std::move(cv.entry)) {
+    std::string_view src = cv;
+    if (!cv.data && cv.size) { // not cached, read from the open fd
+      own.resize(cv.size);
+      for (size_t off = 0; off < own.size(); ) {
+        const size_t n = PCALLR(pread)(cv.fd, own.data()+off,
+          own.size()-off, off);
+        if (n == 0) { own.resize(off); break; }
+        off += n;
+      }
+      src = own;
+    }
+
+    const char* a = src.data();
+    const char* const end = a + src.size();
+    for (const char* p = a; ; ) {
+      const char* const open = std::search(p, end, "<!--", "<!--"+4);
+      if (open == end) break;
+      p = open + 4;
+      while (p < end && *p == ' ') ++p;
+      const char* const type_end = std::find(p, end, ':');
+      if (type_end == end) break;
+      const std::string_view type(p, type_end - p);
+      slot_type t;
+      if (type == "html") t = slot_type::html; else
+      if (type == "js"  ) t = slot_type::js  ; else
+      if (type == "raw" ) t = slot_type::raw ; else continue;
+      const char* const name = type_end + 1;
+      const char* q = name;
+      while (q < end && (isalnum(*q) || *q == '_')) ++q;
+      if (q == name) continue;
+      const std::string_view slot_name(name, q - name);
+      while (q < end && *q == ' ') ++q;
+      if (end - q < 3 || strncmp(q,"-->",3)) continue;
+      fragments.emplace_back(a, open - a);
+      slots.push_back({ slot_name, t });
+      a = p = q + 3;
+    }
+    fragments.emplace_back(a, end - a);
+
+    zfragments.reserve(fragments.size());
+    for (const auto& f : fragments) {
+      static_size += f.size();
+      auto& zf = zfragments.emplace_back();
+      zf.crc = zlib::crc32(0, f.data(), f.size());
+      if (f.empty()) continue;
+      char* z = nullptr;
+      size_t zsize = 0;
+      scope_guard zfree([&]{ free(z); });
+      zlib::deflate_splice(f.data(), f.size(), z, zsize);
+      zf.z.assign(z, zsize);
+      static_zsize += zsize;
+    }
+  }
+};
+
+page_template::page_template(const char* name): name(name) { }
+page_template::~page_template() = default;
+
+std::shared_ptr<const page_template::compiled> page_template::get() const {
+  cache_view cv = file_cache(name, { });
+  auto p = page.load(std::memory_order_acquire);
+  // the cache entry is replaced when the file changes
+  if (p && cv.entry && p->entry == cv.entry) return p;
+  if (!cv.entry) ERROR("empty template ",name);
+  p = std::make_shared<const compiled>(std::move(cv));
+  page.store(p, std::memory_order_release);
+  return p;
+}
+
+void page_template::send(
+  socket sock, values vals, const encoding_list& accept
+) const {
+  const auto p = get();
+  const size_t nslots = p->slots.size();
+
+  // values by slot
+  std::vector<std::string> escaped;
+  escaped.reserve(nslots);
+  std::vector<std::string_view> slot_vals(nslots);
+  size_t size = p->static_size, nstored = 0;
+  for (size_t i=0; i<nslots; ++i) {
+    const auto& slot = p->slots[i];
+    const auto it = std::find_if(vals.begin(), vals.end(),
+      [&](const auto& v){ return v.first == slot.name; });
+    if (it == vals.end()) continue;
+    std::string_view v = it->second;
+    if (needs_escape(v, slot.type))
+      v = escaped.emplace_back(escape(v, slot.type));
+    slot_vals[i] = v;
+    size += v.size();
+    nstored += (v.size() + 0xFFFF - 1) / 0xFFFF;
+  }
+
+  const auto iov_of = [](std::string_view s) -> iovec {
+    return { const_cast<char*>(s.data()), s.size() };
+  };
+  std::vector<iovec> iov;
+  iov.reserve(nslots*2 + nstored + 4);
+  iov.push_back({ }); // header
+  std::string head;
+  std::vector<std::array<char,5>> stored; // stored block headers
+  char tail[2+8] = { 3, 0 }; // empty final fixed block, crc, size
+
+  if (!accept.contains(encoding::gzip)) {
+    for (size_t i=0; ; ++i) {
+      if (const auto& f = p->fragments[i]; !f.empty())
+        iov.push_back(iov_of(f));
+      if (i == nslots) break;
+      if (const auto v = slot_vals[i]; !v.empty())
+        iov.push_back(iov_of(v));
+    }
+    head = header("text/html; charset=UTF-8", size,
+      "Vary: Accept-Encoding\r\n");
+  } else {
+    // one gzip member, values are spliced in as stored blocks
+    static constexpr char gz_head[10] = {
+      0x1f, char(0x8b), 8, 0, 0, 0, 0, 0, 0, 3 };
+    stored.reserve(nstored);
+
+    iov.push_back(iov_of({ gz_head, sizeof(gz_head) }));
+    size_t zsize = sizeof(gz_head) + p->static_zsize + sizeof(tail);
+    unsigned long crc = 0;
+    for (size_t i=0; ; ++i) {
+      const auto& zf = p->zfragments[i];
+      if (!zf.z.empty()) iov.push_back(iov_of(zf.z));
+      crc = zlib::crc32_combine(crc, zf.crc, p->fragments[i].size());
+      if (i == nslots) break;
+      std::string_view v = slot_vals[i];
+      // crc32 of a null pointer is 0, not crc, and unset values are null
+      if (!v.empty()) crc = zlib::crc32(crc, v.data(), v.size());
+      while (!v.empty()) { // byte aligned after the sync flush
+        const uint16_t n = std::min<size_t>(v.size(), 0xFFFF);
+        auto& b = stored.emplace_back(std::array<char,5>{
+          0, char(n), char(n >> 8), char(~n), char(~n >> 8) });
+        iov.push_back(iov_of({ b.data(), b.size() }));
+        iov.push_back(iov_of(v.substr(0,n)));
+        zsize += b.size() + n;
+        v.remove_prefix(n);
+      }
+    }
+    const uint32_t trailer[2] = { uint32_t(crc), uint32_t(size) };
+    for (int j=0; j<2; ++j) // little endian
+      for (int k=0; k<4; ++k) tail[2+j*4+k] = char(trailer[j] >> (8*k));
+    iov.push_back(iov_of({ tail, sizeof(tail) }));
+
+    head = header("text/html; charset=UTF-8", zsize,
+      "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
+  }
+
+  iov[0] = iov_of(head);
+  for (size_t i=0; i<iov.size(); i+=IOV_MAX)
+    sock.write(iov.data()+i, std::min<size_t>(iov.size()-i, IOV_MAX));
+}
+
+}
@@ -0,0 +1,186 @@
+#include "server/pubsub.hh"
+
+#include <algorithm>
+#include <iostream>
+
+namespace ivanp::websocket {
+namespace {
+
+void deliver(
+  pubsub& ps, const std::shared_ptr<const message>& m,
+  const auto& members, size_t a, size_t b
+) {
+  for (; a<b; ++a) {
+    connection& c = *members[a];
+    try {
+      c.send(m);
+    } catch (const std::exception& e) {
+      std::cerr << "\033[31m" << e.what() << "\033[0m" << std::endl;
+      c.shutdown(); // the reader closes it
+      ps.leave(&c);
+    }
+  }
+}
+
+}
+
+pubsub::pubsub(
+  unsigned nowners, std::function<void(unsigned)> wake, size_t mailbox_size
+): nowners(std::max(nowners,1u)), wake(std::move(wake)),
+   boxes(new std::unique_ptr<spsc_queue<post>>[this->nowners*this->nowners]),
+   spills(new std::deque<post>[this->nowners*this->nowners]),
+   pending(new flag[this->nowners]),
+   spilled(new flag[this->nowners*this->nowners])
+{
+  for (unsigned i=0, n=this->nowners*this->nowners; i<n; ++i)
+    boxes[i] = std::make_unique<spsc_queue<post>>(mailbox_size);
+}
+
+void pubsub::join(
+  std::string_view name, std::shared_ptr<connection> c, unsigned owner
+) {
+  if (owner >= nowners) owner = 0;
+  std::lock_guard lock(mx);
+  auto& names =
+    joined.try_emplace(c.get(),membership{owner,{}}).first->second.rooms;
+  if (std::find(names.begin(),names.end(),name) != names.end()) return;
+  names.emplace_back(name);
+
+  auto it = rooms.find(name);
+  if (it == rooms.end()) it = rooms.emplace(name,nullptr).first;
+  auto next = it->second
+    ? std::make_shared<room>(*it->second)
+    : std::make_shared<room>(nowners);
+  (*next)[owner].push_back(std::move(c));
+  it->second = std::move(next);
+}
+
+void pubsub::leave_locked(
+  std::string_view name, const connection* c, unsigned owner
+) {
+  const auto it = rooms.find(name);
+  if (it == rooms.end()) return;
+  auto next = std::make_shared<room>(*it->second);
+  auto& ms = (*next)[owner];
+  ms.erase(std::remove_if(ms.begin(),ms.end(),
+    [c](const auto& m){ return m.get() == c; }), ms.end());
+  if (std::all_of(next->begin(),next->end(),
+    [](const auto& ms){ return ms.empty(); })
+  ) rooms.erase(it);
+  else it->second = std::move(next);
+}
+
+void pubsub::leave(std::string_view name, const connection* c) {
+  std::lock_guard lock(mx);
+  const auto it = joined.find(c);
+  if (it == joined.end()) return;
+  auto& names = it->second.rooms;
+  const auto n = std::find(names.begin(),names.end(),name);
+  if (n == names.end()) return;
+  names.erase(n);
+  const unsigned owner = it->second.owner;
+  if (names.empty()) joined.erase(it);
+  leave_locked(name,c,owner);
+}
+
+void pubsub::leave(const connection* c) {
+  std::lock_guard lock(mx);
+  const auto it = joined.find(c);
+  if (it == joined.end()) return;
+  for (const auto& name : it->second.rooms)
+    leave_locked(name,c,it->second.owner);
+  joined.erase(it);
+}
+
+void pubsub::publish(
+  std::string_view name, std::shared_ptr<const message> m, unsigned from
+) {
+  std::shared_ptr<const room> r;
+  { std::lock_guard lock(mx);
+    const auto it = rooms.find(name);
+    if (it == rooms.end()) return;
+    r = it->second;
+  }
+
+  if (pool) {
+    const auto& ms = r->front();
+    const size_t n = ms.size();
+    // the first batch is written here, while the rest are on the pool
+    for (size_t a = batch_size; a < n; a += batch_size)
+      pool->push([this, m, r, a, b = std::min(a+batch_size,n)]{
+        deliver(*this,m,r->front(),a,b);
+      });
+    deliver(*this,m,ms,0,std::min(batch_size,n));
+    return;
+  }
+
+  if (from >= nowners) { // connections can be written to from any thread
+    for (const auto& ms : *r) deliver(*this,m,ms,0,ms.size());
+    return;
+  }
+  // other owners first, so that they work while this one writes its own
+  for (unsigned to=0; to<nowners; ++to)
+    if (to != from && !(*r)[to].empty()) post_to(to,from,{m,r});
+  deliver(*this,m,(*r)[from],0,(*r)[from].size());
+}
+
+void pubsub::notify(unsigned owner) {
+  // pairs with the fence in drain, so that either the post is seen
+  // or pending was already cleared and the owner gets woken again
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!pending[owner].set.exchange(true)) wake(owner);
+}
+
+void pubsub::post_to(unsigned to, unsigned from, post&& p) {
+  const unsigned i = to*nowners+from;
+  if (!spills[i].empty() || !boxes[i]->try_push(std::move(p))) {
+    // later posts wait behind it, so that members get them in order
+    spills[i].push_back(std::move(p));
+    spilled[i].set.store(true);
+    // pairs with the fence in drain, so that either the owner sees
+    // spilled and wakes this thread, or this sees the room it made
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    unspill(to,from);
+  }
+  notify(to);
+}
+
+bool pubsub::unspill(unsigned to, unsigned from) {
+  const unsigned i = to*nowners+from;
+  auto& spill = spills[i];
+  if (spill.empty()) return false;
+  auto& box = *boxes[i];
+  while (!spill.empty() && box.try_push(std::move(spill.front())))
+    spill.pop_front();
+  if (spill.empty()) spilled[i].set.store(false);
+  return true;
+}
+
+void pubsub::drain(unsigned owner) {
+  pending[owner].set.store(false);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  post p;
+  for (unsigned from=0; from<nowners; ++from) {
+    auto& box = *boxes[owner*nowners+from];
+    while (box.try_pop(p)) {
+      const auto& ms = (*p.to)[owner];
+      deliver(*this,p.m,ms,0,ms.size());
+    }
+  }
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  for (unsigned from=0; from<nowners; ++from)
+    if (spilled[owner*nowners+from].set.load()) notify(from);
+  for (unsigned to=0; to<nowners; ++to)
+    if (to != owner && unspill(to,owner)) notify(to);
+}
+
+size_t pubsub::size(std::string_view name) {
+  std::lock_guard lock(mx);
+  const auto it = rooms.find(name);
+  if (it == rooms.end()) return 0;
+  size_t n = 0;
+  for (const auto& ms : *it->second) n += ms.size();
+  return n;
+}
+
+}
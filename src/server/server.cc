@@ -55,6 +55,14 @@ void server::epoll_add(int fd) {
   PCALL(epoll_ctl)(epoll,EPOLL_CTL_ADD,fd,&event);
 }
 
+void server::watch_writable(int fd) {
+  epoll_event event {
+    .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+    .data = { .fd = fd }
+  };
+  PCALL(epoll_ctl)(epoll,EPOLL_CTL_MOD,fd,&event);
+}
+
 void server::loop() noexcept {
   for (;;) {
     auto n = PCALLR(epoll_wait)(
@@ -65,9 +73,11 @@ void server::loop() noexcept {
         socket fd = e.data.fd;
 
         const auto flags = e.events;
-        if (flags & EPOLLHUP || flags & EPOLLERR || !(flags & EPOLLIN)) {
-          fd.close();
-        } else if (fd == main_socket) {
+        if (fd == main_socket) {
+          if (flags & EPOLLHUP || flags & EPOLLERR) {
+            fd.close();
+            continue;
+          }
           for (;;) {
             sockaddr_in addr;
             socklen_t addr_size = sizeof(addr);
@@ -82,7 +92,9 @@ void server::loop() noexcept {
             epoll_add(sock);
           }
         } else {
-          queue.push(fd);
+          // hangups and errors too, the reader sees them and closes fd
+          // closing it here could let it be reused while still known
+          jobs.push(fd);
         }
       } catch (const std::exception& e) {
         std::cerr << "\033[31m" << e.what() << "\033[0m" << std::endl;
@@ -91,4 +103,57 @@ void server::loop() noexcept {
   }
 }
 
+unsigned server::job_queues::add_worker() {
+  std::lock_guard lock(mx);
+  workers.push_back(std::make_unique<worker>());
+  return workers.size()-1;
+}
+
+void server::job_queues::push(socket fd) {
+  std::unique_lock lock(mx);
+  if (pinned.contains(fd)) {
+    lock.unlock();
+    push(fd % workers.size(), fd);
+    return;
+  }
+  shared.push(fd);
+  if (!idle.empty()) {
+    workers[idle.back()]->cv.notify_one();
+    idle.pop_back();
+  }
+}
+
+void server::job_queues::push(unsigned w, socket fd) {
+  std::lock_guard lock(mx);
+  workers[w]->own.push(fd);
+  workers[w]->cv.notify_one();
+}
+
+socket server::job_queues::pop(unsigned w) {
+  std::unique_lock lock(mx);
+  worker& me = *workers[w];
+  for (;;) {
+    // own first, so that pinned sockets aren't starved by the shared ones
+    auto& q = !me.own.empty() ? me.own : shared;
+    if (!q.empty()) {
+      const socket fd = q.front();
+      q.pop();
+      return fd;
+    }
+    idle.push_back(w);
+    me.cv.wait(lock);
+    std::erase(idle,w); // unless taken off by the notifier
+  }
+}
+
+void server::job_queues::pin(int fd) {
+  std::lock_guard lock(mx);
+  pinned.insert(fd);
+}
+
+void server::job_queues::unpin(int fd) {
+  std::lock_guard lock(mx);
+  pinned.erase(fd);
+}
+
 } // end namespace ivanp
@@ -1,6 +1,9 @@
-#include "socket.hh"
+#include "server/socket.hh"
 
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <thread>
 
 #include "error.hh"
@@ -21,6 +24,15 @@ size_t socket::read(char* buffer, size_t size) const {
   return nread;
 }
 
+ssize_t socket::try_read(char* buffer, size_t size) const {
+  const auto ret = ::read(fd, buffer, size);
+  if (ret < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return -1;
+    else THROW_ERRNO("read()");
+  }
+  return ret;
+}
+
 void socket::write(const char* data, size_t size) const {
   while (size) {
     const auto ret = ::write(fd, data, size);
@@ -35,8 +47,54 @@ void socket::write(const char* data, size_t size) const {
   }
 }
 
+void socket::write(iovec* iov, int iovcnt) const {
+  while (iovcnt) {
+    auto ret = ::writev(fd, iov, iovcnt);
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        std::this_thread::yield();
+        continue;
+      } else THROW_ERRNO("writev()");
+    }
+    for (; iovcnt && size_t(ret) >= iov->iov_len; ++iov, --iovcnt)
+      ret -= iov->iov_len;
+    if (iovcnt) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + ret;
+      iov->iov_len -= ret;
+    }
+  }
+}
+
+ssize_t socket::try_write(const iovec* iov, int iovcnt) const {
+  const auto ret = ::writev(fd, iov, iovcnt);
+  if (ret < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return -1;
+    else THROW_ERRNO("writev()");
+  }
+  return ret;
+}
+
+void socket::sendfile(int in_fd, size_t offset, size_t size) const {
+  off_t off = offset;
+  while (size) {
+    const auto ret = ::sendfile(fd, in_fd, &off, size);
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        std::this_thread::yield();
+        continue;
+      } else THROW_ERRNO("sendfile()");
+    }
+    if (ret == 0) ERROR("sendfile(): file shrank");
+    size -= ret;
+  }
+}
+
 void socket::close() const noexcept {
   ::close(fd);
 }
 
+void socket::shutdown() const noexcept {
+  ::shutdown(fd, SHUT_RDWR);
+}
+
 } // end namespace ivanp
@@ -0,0 +1,106 @@
+#include "server/websocket.hh"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IVANP_WS_X86
+#endif
+
+// unmasking ----------------------------------------------------------
+// the word loops don't depend on endianness
+
+namespace ivanp::websocket::unmask_kernels {
+
+void bytes(char* p, size_t n, const char* m) noexcept {
+  for (size_t i=0; i<n; ++i) p[i] ^= m[i%4];
+}
+
+void words(char* p, size_t n, const char* m) noexcept {
+  uint64_t m8;
+  ::memcpy(&m8,m,4);
+  ::memcpy(reinterpret_cast<char*>(&m8)+4,m,4);
+  for (; n >= 8; p += 8, n -= 8) {
+    uint64_t x;
+    ::memcpy(&x,p,8);
+    x ^= m8;
+    ::memcpy(p,&x,8);
+  }
+  bytes(p,n,m);
+}
+
+#ifdef IVANP_WS_X86
+void sse2(char* p, size_t n, const char* m) noexcept {
+  int32_t m4;
+  ::memcpy(&m4,m,4);
+  const __m128i vm = _mm_set1_epi32(m4);
+  for (; n >= 64; p += 64, n -= 64) {
+    auto* const v = reinterpret_cast<__m128i*>(p);
+    _mm_storeu_si128(v+0, _mm_xor_si128(_mm_loadu_si128(v+0), vm));
+    _mm_storeu_si128(v+1, _mm_xor_si128(_mm_loadu_si128(v+1), vm));
+    _mm_storeu_si128(v+2, _mm_xor_si128(_mm_loadu_si128(v+2), vm));
+    _mm_storeu_si128(v+3, _mm_xor_si128(_mm_loadu_si128(v+3), vm));
+  }
+  for (; n >= 16; p += 16, n -= 16) {
+    auto* const v = reinterpret_cast<__m128i*>(p);
+    _mm_storeu_si128(v, _mm_xor_si128(_mm_loadu_si128(v), vm));
+  }
+  words(p,n,m);
+}
+
+[[gnu::target("avx2")]]
+void avx2(char* p, size_t n, const char* m) noexcept {
+  int32_t m4;
+  ::memcpy(&m4,m,4);
+  const __m256i vm = _mm256_set1_epi32(m4);
+  for (; n >= 128; p += 128, n -= 128) {
+    auto* const v = reinterpret_cast<__m256i*>(p);
+    _mm256_storeu_si256(v+0, _mm256_xor_si256(_mm256_loadu_si256(v+0), vm));
+    _mm256_storeu_si256(v+1, _mm256_xor_si256(_mm256_loadu_si256(v+1), vm));
+    _mm256_storeu_si256(v+2, _mm256_xor_si256(_mm256_loadu_si256(v+2), vm));
+    _mm256_storeu_si256(v+3, _mm256_xor_si256(_mm256_loadu_si256(v+3), vm));
+  }
+  for (; n >= 32; p += 32, n -= 32) {
+    auto* const v = reinterpret_cast<__m256i*>(p);
+    _mm256_storeu_si256(v, _mm256_xor_si256(_mm256_loadu_si256(v), vm));
+  }
+  // gcc leaves it out before the tail call, and sse2 code after dirty
+  // upper halves is many times slower
+  _mm256_zeroupper();
+  sse2(p,n,m);
+}
+#endif
+
+}
+
+namespace {
+
+#ifdef IVANP_WS_X86
+const auto unmask_kernel = __builtin_cpu_supports("avx2")
+  ? ivanp::websocket::unmask_kernels::avx2
+  : ivanp::websocket::unmask_kernels::sse2;
+constexpr size_t unmask_align = 32;
+#else
+const auto unmask_kernel = ivanp::websocket::unmask_kernels::words;
+constexpr size_t unmask_align = 8;
+#endif
+
+}
+
+namespace ivanp::websocket {
+
+void unmask(char* p, size_t n, const char* mask, size_t phase) noexcept {
+  // bytewise up to an aligned address, so that vector stores don't split
+  size_t head = -reinterpret_cast<uintptr_t>(p) & (unmask_align-1);
+  if (head > n) head = n;
+  for (size_t i=0; i<head; ++i) p[i] ^= mask[(phase+i)%4];
+  phase += head;
+  if (n -= head) {
+    char m[4];
+    for (int i=0; i<4; ++i) m[i] = mask[(phase+i)%4];
+    unmask_kernel(p+head, n, m);
+  }
+}
+
+}
@@ -0,0 +1,233 @@
+#include "server/websocket.hh"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IVANP_WS_X86
+#endif
+
+namespace {
+
+// UTF-8 validation ---------------------------------------------------
+// the lookup algorithm of Keiser and Lemire, as in simdjson
+// each byte is checked against the 3 before it, so a block only needs
+// the end of the previous one, and any error can be found in one pass
+// the nibbles of a byte and of the one before it index three tables,
+// whose entries are sets of errors, all three agreeing means an error
+
+using ivanp::websocket::utf8_state;
+
+enum : uint8_t {
+  too_short = 1<<0, // a lead byte not followed by enough continuations
+  too_long = 1<<1, // a continuation without a lead byte
+  overlong_3 = 1<<2,
+  too_large = 1<<3, // over U+10FFFF
+  surrogate = 1<<4,
+  overlong_2 = 1<<5,
+  too_large_1000 = 1<<6,
+  overlong_4 = 1<<6,
+  two_conts = 1<<7, // the second continuation, checked below
+  carry = too_short | too_long | two_conts
+};
+
+// by the high nibble of the previous byte
+constexpr uint8_t utf8_byte_1_high[16] {
+  too_long, too_long, too_long, too_long,
+  too_long, too_long, too_long, too_long,
+  two_conts, two_conts, two_conts, two_conts,
+  too_short | overlong_2,
+  too_short,
+  too_short | overlong_3 | surrogate,
+  too_short | too_large | too_large_1000 | overlong_4
+};
+// by the low nibble of the previous byte
+constexpr uint8_t utf8_byte_1_low[16] {
+  carry | overlong_3 | overlong_2 | overlong_4,
+  carry | overlong_2,
+  carry,
+  carry,
+  carry | too_large,
+  carry | too_large | too_large_1000,
+  carry | too_large | too_large_1000,
+  carry | too_large | too_large_1000,
+  carry | too_large | too_large_1000,
+  carry | too_large | too_large_1000,
+  carry | too_large | too_large_1000,
+  carry | too_large | too_large_1000,
+  carry | too_large | too_large_1000,
+  carry | too_large | too_large_1000 | surrogate,
+  carry | too_large | too_large_1000,
+  carry | too_large | too_large_1000
+};
+// by the high nibble of the byte
+constexpr uint8_t utf8_byte_2_high[16] {
+  too_short, too_short, too_short, too_short,
+  too_short, too_short, too_short, too_short,
+  too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4,
+  too_long | overlong_2 | two_conts | overlong_3 | too_large,
+  too_long | overlong_2 | two_conts | surrogate | too_large,
+  too_long | overlong_2 | two_conts | surrogate | too_large,
+  too_short, too_short, too_short, too_short
+};
+
+void keep_last(utf8_state& st, const char* p, size_t n) noexcept {
+  if (n >= 3) ::memcpy(st.prev,p+n-3,3);
+  else {
+    ::memmove(st.prev,st.prev+n,3-n);
+    ::memcpy(st.prev+3-n,p,n);
+  }
+}
+
+// m is null if p isn't masked
+void utf8_bytes(char* p, size_t n, const char* m, utf8_state& st) noexcept {
+  uint64_t m8 = 0;
+  if (m) {
+    ::memcpy(&m8,m,4);
+    ::memcpy(reinterpret_cast<char*>(&m8)+4,m,4);
+  }
+  uint8_t p3 = st.prev[0], p2 = st.prev[1], p1 = st.prev[2], err = 0;
+  for (size_t i=0; i<n; ) {
+    // after an ASCII byte, anything unfinished was already an error
+    if (p1 < 0x80 && n-i >= 8 && i%4 == 0) {
+      uint64_t x;
+      ::memcpy(&x,p+i,8);
+      x ^= m8;
+      if (!(x & 0x8080808080808080)) {
+        if (m) ::memcpy(p+i,&x,8);
+        i += 8;
+        p3 = p2 = p1 = 0;
+        continue;
+      }
+    }
+    if (m) p[i] ^= m[i%4];
+    const uint8_t c = p[i++];
+    if ((c | p1) >= 0x80 || p2 >= 0xE0 || p3 >= 0xF0) {
+      const uint8_t sc = utf8_byte_1_high[p1>>4]
+        & utf8_byte_1_low[p1&0xF] & utf8_byte_2_high[c>>4];
+      // the third and fourth bytes of a sequence must be continuations
+      const uint8_t must23 = (p2 >= 0xE0 || p3 >= 0xF0) ? 0x80 : 0;
+      err |= sc ^ must23;
+    }
+    p3 = p2;
+    p2 = p1;
+    p1 = c;
+  }
+  keep_last(st,p,n);
+  st.error |= err;
+}
+
+#ifdef IVANP_WS_X86
+template <int N>
+[[gnu::target("avx2")]]
+inline __m256i utf8_prev(__m256i in, __m256i prev) noexcept {
+  return _mm256_alignr_epi8(in,_mm256_permute2x128_si256(prev,in,0x21),16-N);
+}
+
+[[gnu::target("avx2")]]
+inline __m256i utf8_table(const uint8_t* t) noexcept {
+  const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t));
+  return _mm256_broadcastsi128_si256(x);
+}
+
+// errors of the bytes of in, prev is the block before it
+[[gnu::target("avx2")]]
+inline __m256i utf8_check(__m256i in, __m256i prev) noexcept {
+  const __m256i low = _mm256_set1_epi8(0xF);
+  const __m256i prev1 = utf8_prev<1>(in,prev);
+  const __m256i sc = _mm256_and_si256(_mm256_and_si256(
+    _mm256_shuffle_epi8(utf8_table(utf8_byte_1_high),
+      _mm256_and_si256(_mm256_srli_epi16(prev1,4),low)),
+    _mm256_shuffle_epi8(utf8_table(utf8_byte_1_low),
+      _mm256_and_si256(prev1,low))),
+    _mm256_shuffle_epi8(utf8_table(utf8_byte_2_high),
+      _mm256_and_si256(_mm256_srli_epi16(in,4),low)));
+  const __m256i must23 = _mm256_or_si256(
+    _mm256_subs_epu8(utf8_prev<2>(in,prev),_mm256_set1_epi8(0xE0-0x80)),
+    _mm256_subs_epu8(utf8_prev<3>(in,prev),_mm256_set1_epi8(0xF0-0x80)));
+  return _mm256_xor_si256(
+    _mm256_and_si256(must23,_mm256_set1_epi8(char(0x80))), sc);
+}
+
+// an all ASCII block is only wrong after an unfinished sequence
+[[gnu::target("avx2")]]
+inline __m256i utf8_incomplete(__m256i prev) noexcept {
+  return _mm256_subs_epu8(prev,_mm256_setr_epi8(
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    0xF0-1, 0xE0-1, 0xC0-1));
+}
+
+template <bool masked>
+[[gnu::target("avx2")]]
+void utf8_avx2(char* p, size_t n, const char* m, utf8_state& st) noexcept {
+  char* const p0 = p;
+  const size_t n0 = n;
+  int32_t m4 = 0;
+  if constexpr (masked) ::memcpy(&m4,m,4);
+  const __m256i vm = _mm256_set1_epi32(m4);
+
+  __m256i prev = _mm256_setr_epi8(
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    st.prev[0], st.prev[1], st.prev[2]);
+  __m256i err = _mm256_setzero_si256();
+  for (; n >= 32; p += 32, n -= 32) {
+    auto* const v = reinterpret_cast<__m256i*>(p);
+    __m256i in = _mm256_loadu_si256(v);
+    if constexpr (masked) {
+      in = _mm256_xor_si256(in,vm);
+      _mm256_storeu_si256(v,in);
+    }
+    err = _mm256_or_si256(err, _mm256_movemask_epi8(in)
+      ? utf8_check(in,prev) : utf8_incomplete(prev));
+    prev = in;
+  }
+  if (n) { // padded, ignoring errors found in the padding
+    if constexpr (masked) for (size_t i=0; i<n; ++i) p[i] ^= m[i%4];
+    alignas(32) char buf[32] { };
+    ::memcpy(buf,p,n);
+    static constexpr char ones[64] {
+      -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+      -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
+    };
+    const __m256i keep = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i*>(ones+32-n));
+    err = _mm256_or_si256(err, _mm256_and_si256(keep,
+      utf8_check(_mm256_load_si256(reinterpret_cast<__m256i*>(buf)),prev)));
+  }
+  keep_last(st,p0,n0);
+  st.error |= !_mm256_testz_si256(err,err);
+}
+
+void utf8_plain_bytes(char* p, size_t n, const char*, utf8_state& st)
+noexcept { utf8_bytes(p,n,nullptr,st); }
+
+const bool has_avx2 = __builtin_cpu_supports("avx2");
+const auto utf8_kernel = has_avx2 ? utf8_avx2<true> : utf8_bytes;
+const auto utf8_plain_kernel =
+  has_avx2 ? utf8_avx2<false> : utf8_plain_bytes;
+#else
+const auto utf8_kernel = utf8_bytes;
+void utf8_plain_kernel(char* p, size_t n, const char*, utf8_state& st)
+noexcept { utf8_bytes(p,n,nullptr,st); }
+#endif
+
+}
+
+namespace ivanp::websocket {
+
+void validate_utf8(const char* p, size_t n, utf8_state& st) noexcept {
+  // only written to if masked
+  utf8_plain_kernel(const_cast<char*>(p),n,nullptr,st);
+}
+
+void unmask(
+  char* p, size_t n, const char* mask, size_t phase, utf8_state& st
+) noexcept {
+  char m[4];
+  for (int i=0; i<4; ++i) m[i] = mask[(phase+i)%4];
+  utf8_kernel(p,n,m,st);
+}
+
+}
@@ -1,28 +1,27 @@
 #include "server/websocket.hh"
 
 #include <tuple>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 
 #include <netinet/in.h>
+#include <sys/uio.h>
 #include <openssl/sha.h>
 
 #include "base64.hh"
+#include "zlib.hh"
 #include "debug.hh"
 
 namespace {
 
-constexpr union {
-  unsigned char u;
-  char c;
-} none_set_byte = { .u = (unsigned char)0u };
-constexpr union {
-  unsigned char u;
-  char c;
-} all_set_byte = { .u = (unsigned char)~0u };
-constexpr bool none_set(char c) noexcept { return c == none_set_byte.c; }
-constexpr bool  all_set(char c) noexcept { return c ==  all_set_byte.c; }
+// larger reassembly buffers are freed after their message
+constexpr size_t max_kept_message = 1 << 16;
 
 template <typename T>
-void buffread(char*& buff, T& x) {
+void buffread(const char*& buff, T& x) {
   ::memcpy(&x,buff,sizeof(T));
   buff += sizeof(T);
 }
@@ -31,7 +30,201 @@ void buffread(char*& buff, T& x) {
 
 namespace ivanp::websocket {
 
-void handshake(file_desc& sock, const http::request& req) {
+namespace {
+
+// permessage-deflate ------------------------------------------------
+
+std::string_view trim(std::string_view s) noexcept {
+  while (!s.empty() && (s.front()==' ' || s.front()=='\t'))
+    s.remove_prefix(1);
+  while (!s.empty() && (s.back()==' ' || s.back()=='\t'))
+    s.remove_suffix(1);
+  return s;
+}
+
+// calls f for each part of s between separators
+template <typename F>
+void split(std::string_view s, char sep, F&& f) {
+  for (;;) {
+    const auto i = s.find(sep);
+    f(trim(s.substr(0,i)));
+    if (i == s.npos) break;
+    s.remove_prefix(i+1);
+  }
+}
+
+int window_bits(std::string_view v) noexcept {
+  if (v.size() > 2 && v.front()=='"' && v.back()=='"')
+    v = v.substr(1,v.size()-2);
+  if (v.size() == 1 && '8' <= v[0] && v[0] <= '9') return v[0]-'0';
+  if (v.size() == 2 && v[0] == '1' && '0' <= v[1] && v[1] <= '5')
+    return 10 + v[1]-'0';
+  return 0;
+}
+
+// accepts the offer if it's acceptable, returning the response
+std::string accept_deflate(std::string_view offer, deflate_params& d) {
+  deflate_params p {
+    .enabled = true,
+    .server_context_takeover = deflate_context_takeover,
+    .client_context_takeover = deflate_client_context_takeover,
+    .server_window_bits = uint8_t(deflate_window_bits)
+  };
+  bool ok = true, first = true;
+  unsigned seen = 0;
+  int server_bits = 0;
+  split(offer, ';', [&](std::string_view param){
+    if (first) {
+      first = false;
+      ok = param == "permessage-deflate";
+      return;
+    }
+    if (!ok) return;
+    const auto eq = param.find('=');
+    const auto key = trim(param.substr(0,eq));
+    const auto val =
+      eq == param.npos ? std::string_view() : trim(param.substr(eq+1));
+    unsigned bit;
+    if (key == "server_no_context_takeover" && val.empty()) {
+      bit = 1;
+      p.server_context_takeover = false;
+    } else if (key == "client_no_context_takeover" && val.empty()) {
+      bit = 2;
+      p.client_context_takeover = false;
+    } else if (key == "server_max_window_bits") {
+      bit = 4;
+      // zlib can't deflate with a 256 byte window
+      server_bits = window_bits(val);
+      if (server_bits < 9) ok = false;
+      else if (server_bits < p.server_window_bits)
+        p.server_window_bits = server_bits;
+    } else if (key == "client_max_window_bits") {
+      // inflate streams are made for the largest window anyway
+      bit = 8;
+      if (!val.empty() && !window_bits(val)) ok = false;
+    } else {
+      bit = 0;
+      ok = false;
+    }
+    if (seen & bit) ok = false;
+    seen |= bit;
+  });
+  if (!ok) return { };
+
+  d = p;
+  std::string r = "permessage-deflate";
+  if (!p.server_context_takeover) r += "; server_no_context_takeover";
+  if (!p.client_context_takeover) r += "; client_no_context_takeover";
+  if (server_bits)
+    r += "; server_max_window_bits=" + std::to_string(p.server_window_bits);
+  return r;
+}
+
+// raw deflate without the trailing 00 00 ff ff, RFC 7692 7.2.1
+void deflate_message(
+  zlib::deflate_stream& zs, std::string_view in, std::string& out
+) {
+  const char* p = in.data();
+  size_t n = in.size(), used = 0;
+  out.resize(n/2 + 64);
+  for (bool flushed = false; !flushed; ) {
+    if (out.size() - used < 64) out.resize(out.size()*2);
+    char* o = out.data() + used;
+    size_t avail = out.size() - used;
+    if (n) zs(p,n,o,avail);
+    else flushed = zs.sync_flush(o,avail);
+    used = out.size() - avail;
+  }
+  out.resize(used - 4);
+}
+
+// compresses with a stream owned by the thread, reset after each message
+void deflate_once(int bits, std::string_view in, std::string& out) {
+  thread_local std::unique_ptr<zlib::deflate_stream> streams[16-9];
+  auto& zs = streams[bits-9];
+  if (!zs) zs = std::make_unique<zlib::deflate_stream>(deflate_level,-bits);
+  deflate_message(*zs,in,out);
+  zs->reset();
+}
+
+// header of a server frame, at most 10 bytes, returns its length
+size_t write_head(
+  char* out, size_t size, head::type opcode, bool compressed
+) noexcept {
+  //    0                   1                   2                   3
+  //  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+  // +-+-+-+-+-------+-+-------------+-------------------------------+
+  // |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
+  // |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
+  // |N|V|V|V|       |S|             |   (if payload len==126/127)   |
+  // | |1|2|3|       |K|             |                               |
+  // +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
+  // |     Extended payload length continued, if payload len == 127  |
+  // + - - - - - - - - - - - - - - - +-------------------------------+
+  // |                               |          Payload Data         |
+  // +-------------------------------- - - - - - - - - - - - - - - - +
+  // :                     Payload Data continued ...                :
+  // + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
+  // |                     Payload Data continued ...                |
+  // +---------------------------------------------------------------+
+
+  head h {
+    .opcode = opcode,
+    .rsv = compressed ? head::rsv1 : head::type(0)
+  };
+  size_t n = 2;
+  if (size < 126) {
+    h.len = size;
+  } else if (size <= 0xFFFF) {
+    h.len = 126;
+    const uint16_t len = htons(size);
+    ::memcpy(out+2,&len,2);
+    n += 2;
+  } else {
+    h.len = 127;
+    for (int i=0; i<8; ++i) out[2+i] = size >> (8*(7-i));
+    n += 8;
+  }
+  ::memcpy(out,&h,2);
+  return n;
+}
+
+// streams of connections without client context takeover
+// are only held during a message, and returned here between messages
+thread_local std::vector<std::unique_ptr<zlib::inflate_stream>> inflaters;
+constexpr size_t max_pooled_inflaters = 16;
+
+std::unique_ptr<zlib::inflate_stream> take_inflater() {
+  if (inflaters.empty()) return std::make_unique<zlib::inflate_stream>();
+  auto zs = std::move(inflaters.back());
+  inflaters.pop_back();
+  return zs;
+}
+void give_inflater(std::unique_ptr<zlib::inflate_stream>& zs) {
+  zs->reset();
+  if (inflaters.size() < max_pooled_inflaters)
+    inflaters.push_back(std::move(zs));
+  zs.reset();
+}
+
+// outbound queues ---------------------------------------------------
+std::atomic<size_t> n_frames, n_bytes, n_max_bytes,
+  n_dropped, n_disconnected, n_blocked;
+
+}
+
+queue_stats get_queue_stats() noexcept {
+  return {
+    .frames = n_frames,
+    .bytes = n_bytes,
+    .max_bytes = n_max_bytes,
+    .dropped = n_dropped,
+    .disconnected = n_disconnected,
+    .blocked = n_blocked
+  };
+}
+
+std::string handshake(const http::request& req, deflate_params& deflate) {
   auto check_header = [
     &req
   ](std::string_view name, const auto&... x) {
@@ -76,15 +269,25 @@ void handshake(file_desc& sock, const http::request& req) {
   );
   key2 = base64_encode(hash,SHA_DIGEST_LENGTH);
   // TEST(key2)
-  sock << cat(
+
+  // the first acceptable offer is taken
+  deflate = { };
+  std::string ext;
+  if (deflate_enabled)
+    for (auto [it,end] = req["Sec-WebSocket-Extensions"]; it!=end; ++it)
+      split(it->second, ',', [&](std::string_view offer){
+        if (ext.empty()) ext = accept_deflate(offer,deflate);
+      });
+
+  return cat(
     "HTTP/1.1 101 Switching Protocols\r\n"
     "Connection: Upgrade\r\n"
     "Upgrade: websocket\r\n"
     "Sec-WebSocket-Accept: ",key2,"\r\n"
-    "Sec-WebSocket-Protocol: ",protocol,"\r\n\r\n"
+    "Sec-WebSocket-Protocol: ",protocol,"\r\n",
+    ext.empty() ? "" : cat("Sec-WebSocket-Extensions: ",ext,"\r\n"),
+    "\r\n"
   );
-
-  INFO("35;1","New websocket ",*sock);
 }
 
 uint16_t frame::code() const noexcept {
@@ -96,37 +299,7 @@ uint16_t frame::code() const noexcept {
   return code;
 }
 
-frame receive_frame(file_desc& sock, char* buffer, size_t size) {
-  const auto nread = sock.read(buffer,size);
-  if (nread==0) ERROR("empty ws frame");
-  auto frame = parse_frame(buffer,size);
-
-  switch (frame.opcode) {
-    case head::text:
-    case head::bin:
-      break; // proceed normally
-    case head::close: {
-      INFO("35;1","closing ws ",*sock,", code: ",frame.code());
-      // TODO: send response
-      sock.close();
-      frame.payload = { };
-    }; break;
-    case head::ping: {
-      INFO("35;1","ping from ",*sock);
-      send_frame(sock,buffer,size,{},head::pong); // reply with pong
-      frame.payload = { };
-    }; break;
-    case head::pong: {
-      INFO("35;1","pong from ",*sock);
-      send_frame(sock,buffer,size,{},head::ping); // reply with ping
-      frame.payload = { };
-    }; break;
-  }
-
-  return frame;
-}
-
-frame parse_frame(char* buff, size_t bufflen) {
+size_t parse_head(const char* buff, size_t size, frame_head& h) {
   //    0                   1                   2                   3
   //  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
   // +-+-+-+-+-------+-+-------------+-------------------------------+
@@ -146,105 +319,510 @@ frame parse_frame(char* buff, size_t bufflen) {
   // |                     Payload Data continued ...                |
   // +---------------------------------------------------------------+
 
-  head head;
   static_assert(sizeof(head)==2);
-  uint64_t len;
+  if (size < 2) return 0;
+  const char* const begin = buff;
+  buffread(buff,static_cast<head&>(h));
 
-  buffread(buff,head);
-  TEST(unsigned(head.len))
+  const size_t len_size = h.len<126 ? 0 : h.len<127 ? 2 : 8;
+  if (size < 2 + len_size + (h.mask ? 4 : 0)) return 0;
 
-  if (head.fin == 0) ERROR("fin==0 not yet implemented");
-  if (head.rsv != 0) ERROR("rsv!=0 not implemented");
+  switch (h.opcode) {
+    case head::cont:
+    case head::text:
+    case head::bin:
+      break;
+    case head::close:
+    case head::ping:
+    case head::pong:
+      if (!h.fin) ERROR("fragmented control frame");
+      if (h.len > 125) ERROR("control frame payload over 125 bytes");
+      break;
+    default:
+      ERROR("unknown opcode ",std::to_string(h.opcode));
+  }
 
-  if (head.len<126) {
-    len = head.len;
-  } else if (head.len<127) {
-    union {
-      uint16_t tmp;
-      uint8_t bytes[2];
-    };
+  if (len_size == 0) {
+    h.size = h.len;
+  } else if (len_size == 2) {
+    uint16_t tmp;
     buffread(buff,tmp);
-    std::swap(bytes[0],bytes[1]);
-    len = tmp;
+    h.size = ntohs(tmp);
   } else {
-    union {
-      uint64_t tmp;
-      uint8_t bytes[8];
-    };
-    buffread(buff,tmp);
-    for (int i=4; i; ) --i, std::swap(bytes[i],bytes[7-i]);
-    len = tmp;
-  }
-  TEST(len)
-
-  if (len > bufflen) ERROR("frame length exceeds buffer length");
-
-  if (len) {
-    if (head.mask) {
-      char mask[4];
-      buffread(buff,mask);
-
-      int nset = 0;
-      for (int i=0; i<4; ++i) {
-        if (none_set(mask[i])) {
-        } else if (all_set(mask[i])) {
-          ++nset;
-        } else {
-          nset = -1;
-          break;
+    uint8_t bytes[8];
+    buffread(buff,bytes);
+    h.size = 0;
+    for (int i=0; i<8; ++i) h.size = (h.size << 8) | bytes[i];
+    if (h.size >> 63) ERROR("payload length has the most significant bit set");
+  }
+
+  if (!h.mask) ERROR("client sent no mask");
+  buffread(buff,h.key);
+  uint32_t m4;
+  ::memcpy(&m4,h.key,4);
+  if (m4==0 || m4==uint32_t(-1))
+    ERROR((m4 ? "all" : "no")," mask bits are set");
+
+  return buff - begin;
+}
+
+message::parts message::frame(const deflate_params& d) const {
+  if (d.enabled && payload.size() >= deflate_min_size) {
+    auto& v = variants[d.server_window_bits - 8];
+    std::call_once(v.once, [&]{
+      deflate_once(d.server_window_bits,payload,v.payload);
+      if (v.payload.size() < payload.size())
+        v.head_size = write_head(v.head,v.payload.size(),opcode,true);
+      else std::string().swap(v.payload);
+    });
+    if (v.head_size) return { { v.head, v.head_size }, v.payload };
+  }
+  auto& v = variants[0];
+  std::call_once(v.once, [&]{
+    v.head_size = write_head(v.head,payload.size(),opcode,false);
+  });
+  return { { v.head, v.head_size }, payload };
+}
+
+connection::connection(
+  socket sock, deflate_params deflate, bool stream
+) noexcept: sock(sock), stream(stream), deflate(deflate) { }
+connection::~connection() {
+  n_frames -= out.size();
+  n_bytes -= out_bytes;
+}
+
+void connection::close() noexcept {
+  std::lock_guard lock(mx_write);
+  close_locked();
+}
+
+void connection::close_locked() noexcept {
+  if (closed) return;
+  sock.close();
+  closed = true;
+  while (!out.empty()) pop_front();
+}
+
+void connection::send_close(uint16_t code, std::string_view reason) {
+  char p[125] { char(code >> 8), char(code) };
+  const size_t n = std::min(reason.size(),sizeof(p)-2);
+  ::memcpy(p+2,reason.data(),n);
+  write({p,n+2},head::close,false);
+  beat = beat_state::closing;
+}
+
+void connection::close(uint16_t code, std::string_view reason) {
+  std::lock_guard lock(mx_write);
+  if (!closed && beat != beat_state::closing) send_close(code,reason);
+}
+
+void connection::shutdown() noexcept {
+  std::lock_guard lock(mx_write);
+  hang_up_locked();
+}
+
+void connection::hang_up_locked() noexcept {
+  if (closed) return;
+  sock.shutdown();
+  beat = beat_state::closing; // drops later sends
+  while (!out.empty()) pop_front();
+}
+
+unsigned connection::tick(unsigned interval, unsigned timeout) {
+  std::lock_guard lock(mx_write);
+  if (closed) return 0;
+  // anything received counts as an answer
+  const bool alive = heard.exchange(false,std::memory_order_relaxed);
+  switch (beat) {
+    case beat_state::idle:
+      if (alive) return interval;
+      ++ping_id;
+      write({reinterpret_cast<const char*>(&ping_id),sizeof(ping_id)},
+        head::ping,false);
+      beat = beat_state::pinged;
+      return timeout;
+    case beat_state::pinged:
+      if (!alive) {
+        INFO("35;1","ping timeout on ws ",std::to_string(sock));
+        send_close(going_away,"ping timeout");
+        return timeout;
+      }
+      [[fallthrough]];
+    case beat_state::ponged:
+      beat = beat_state::idle;
+      return interval > timeout ? interval - timeout : 1;
+    case beat_state::closing: // no answer to the close frame
+      sock.shutdown();
+      break;
+  }
+  return 0;
+}
+
+bool connection::fail(uint16_t code, std::string_view reason) {
+  std::lock_guard lock(mx_write);
+  if (!closed && beat != beat_state::closing) send_close(code,reason);
+  hang_up_locked();
+  return false;
+}
+
+bool connection::receive(char* buffer, size_t size, const handler& f) {
+  for (;;) {
+    const auto ret = sock.try_read(buffer+ncarry,size-ncarry);
+    if (ret < 0) return true; // drained, wait for the next edge
+    if (ret == 0) { // peer closed without a close frame
+      shutdown();
+      return false;
+    }
+    heard.store(true,std::memory_order_relaxed);
+    ::memcpy(buffer,carry,ncarry);
+    // a short read means the socket was drained
+    const bool more = size_t(ret) == size-ncarry;
+    if (!decode(buffer,ncarry+ret,f)) return false;
+    if (!more) return true;
+  }
+}
+
+bool connection::decode(char* p, size_t n, const handler& f) {
+  while (n || in_frame) {
+    if (!in_frame) { // at a frame boundary
+      const size_t hn = parse_head(p,n,cur);
+      if (!hn) break;
+
+      if (cur.control()) { // may come between fragments of a message
+        if (cur.rsv) ERROR("rsv bits set on a control frame");
+        if (n-hn < cur.size) break; // handled once whole
+        p += hn;
+        unmask(p,cur.size,cur.key);
+        const frame fr { cur, { p, cur.size } };
+        p += cur.size;
+        n -= hn + cur.size;
+
+        std::lock_guard lock(mx_write);
+        switch (cur.opcode) {
+          case head::close: {
+            INFO("35;1","closing ws ",std::to_string(sock),
+              ", code: ",std::to_string(fr.code()));
+            if (beat != beat_state::closing) // else this is the answer
+              write(fr.payload.substr(0,2),head::close,false);
+            hang_up_locked();
+            return false;
+          }
+          case head::ping: {
+            INFO("35;1","ping from ",std::to_string(sock));
+            write(fr.payload,head::pong,false);
+          }; break;
+          case head::pong: { // unsolicited pongs are allowed and ignored
+            if (beat == beat_state::pinged
+              && fr.size() == sizeof(ping_id)
+              && !::memcmp(fr.data(),&ping_id,sizeof(ping_id))
+            ) beat = beat_state::ponged;
+          }; break;
         }
+        continue;
       }
-      if (nset==0 || nset==4)
-        ERROR((nset ? "all" : "no")," mask bits are set");
 
-      for (uint64_t i=0; i<len; ++i)
-        buff[i] ^= mask[i%4];
-    } else ERROR("client sent no mask");
+      if (cur.opcode == head::cont) {
+        if (msg_opcode == head::cont)
+          ERROR("continuation frame without a message");
+        if (cur.rsv) ERROR("rsv bits set on a continuation frame");
+      } else {
+        if (msg_opcode != head::cont)
+          ERROR("new message before the previous one was finished");
+        if (cur.rsv && (cur.rsv != head::rsv1 || !deflate.enabled))
+          ERROR("unexpected rsv bits");
+        msg_opcode = cur.opcode;
+        msg_compressed = cur.rsv;
+        msg_size = msg_inflated = 0;
+        utf8 = { };
+      }
+      if (cur.size > max_message_size - msg_size)
+        ERROR("message exceeds max_message_size");
+      msg_size += cur.size;
+      p += hn;
+      n -= hn;
+
+      if (!stream && !msg_compressed && cur.fin && msg.empty()
+        && cur.size <= n
+      ) {
+        // whole message in the buffer, no need to copy
+        if (msg_opcode == head::text) {
+          unmask(p,cur.size,cur.key,0,utf8);
+          if (!utf8.complete()) return fail(invalid_data,"invalid UTF-8");
+        } else unmask(p,cur.size,cur.key);
+        frame part { };
+        part.opcode = msg_opcode;
+        part.payload = { p, cur.size };
+        p += cur.size;
+        n -= cur.size;
+        msg_opcode = head::cont;
+        f(part);
+        continue;
+      }
+
+      in_frame = true;
+      left = cur.size;
+      phase = 0;
+    }
+
+    const size_t k = std::min<uint64_t>(left,n);
+    const bool text = msg_opcode == head::text;
+    if (text && !msg_compressed) unmask(p,k,cur.key,phase,utf8);
+    else unmask(p,k,cur.key,phase);
+    left -= k;
+    phase += k;
+
+    frame part { };
+    part.opcode = msg_opcode;
+    part.fin = cur.fin && !left;
+    if (text && !msg_compressed
+      && (part.fin ? !utf8.complete() : utf8.error)
+    ) return fail(invalid_data,"invalid UTF-8");
+    if (msg_compressed) {
+      if (!inflate(p,k,part.fin,f))
+        return fail(invalid_data,"invalid UTF-8");
+    } else if (stream) {
+      part.payload = { p, k };
+      if (k || part.fin) f(part);
+    } else {
+      msg.append(p,k);
+    }
+    p += k;
+    n -= k;
+    if (left) break; // wait for the rest of the payload
+
+    in_frame = false;
+    if (cur.fin) {
+      if (!stream) {
+        part.payload = msg;
+        f(part);
+        // don't hold on to the memory of a large message
+        if (msg.capacity() > max_kept_message) msg = { };
+        else msg.clear();
+      }
+      if (msg_compressed && !deflate.client_context_takeover)
+        give_inflater(inflater);
+      msg_opcode = head::cont;
+    }
   }
 
-  return { head, { buff, len } };
+  // at most an incomplete header or control frame
+  ::memcpy(carry,p,n);
+  ncarry = n;
+  return true;
 }
 
-void send_frame(
-  file_desc& sock, char* buffer, size_t size,
-  std::string_view message, head::type opcode
+bool connection::inflate(
+  const char* p, size_t n, bool last, const handler& f
 ) {
-  //    0                   1                   2                   3
-  //  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-  // +-+-+-+-+-------+-+-------------+-------------------------------+
-  // |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
-  // |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
-  // |N|V|V|V|       |S|             |   (if payload len==126/127)   |
-  // | |1|2|3|       |K|             |                               |
-  // +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
-  // |     Extended payload length continued, if payload len == 127  |
-  // + - - - - - - - - - - - - - - - +-------------------------------+
-  // |                               |          Payload Data         |
-  // +-------------------------------- - - - - - - - - - - - - - - - +
-  // :                     Payload Data continued ...                :
-  // + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
-  // |                     Payload Data continued ...                |
-  // +---------------------------------------------------------------+
+  if (!inflater) inflater = take_inflater();
+  static constexpr char tail[4] = { 0, 0, '\xFF', '\xFF' };
+  thread_local char buf[1 << 14];
 
-  if (message.size()+10 > size) ERROR(
-    "The message is too long for buffer of size ", size);
-  ::memcpy(buffer += 10, message.data(), size = message.size());
-
-  head head { .opcode = opcode };
-  if (size<126) {
-    head.len = size;
-  } else if (size <= (uint16_t)-1) {
-    head.len = 126;
-    uint16_t size2 = size;
-    ::memcpy(buffer-=2,&size2,2);
-    size += 2;
-  } else {
-    head.len = 127;
-    ::memcpy(buffer-=8,&size,8);
-    size += 8;
+  frame part { };
+  part.opcode = msg_opcode;
+  const bool text = msg_opcode == head::text;
+  auto run = [&](const char* in, size_t in_size, bool fin) {
+    for (;;) {
+      char* out = buf;
+      size_t avail = sizeof(buf);
+      // a final block may end the stream early, the rest is ignored
+      if ((*inflater)(in,in_size,out,avail)) {
+        inflater->reset();
+        in_size = 0;
+      }
+      const size_t k = out - buf;
+      if ((msg_inflated += k) > max_message_size)
+        ERROR("message exceeds max_message_size");
+      const bool done = !in_size && avail;
+      if (text) {
+        validate_utf8(buf,k,utf8);
+        if (fin && done ? !utf8.complete() : utf8.error) return false;
+      }
+      if (stream) {
+        part.fin = fin && done;
+        part.payload = { buf, k };
+        if (k || part.fin) f(part);
+      } else {
+        msg.append(buf,k);
+      }
+      if (done) return true;
+    }
+  };
+  return run(p,n,false) && (!last || run(tail,sizeof(tail),true));
+}
+
+void connection::write(
+  std::string_view payload, head::type opcode, bool compressed,
+  std::shared_ptr<const void> owner
+) {
+  char h[10];
+  const size_t n = write_head(h,payload.size(),opcode,compressed);
+  enqueue(std::move(owner),{h,n},payload,opcode & 0x8);
+}
+
+void connection::enqueue(
+  std::shared_ptr<const void> owner,
+  std::string_view head, std::string_view payload, bool control
+) {
+  if (closed || beat == beat_state::closing) return;
+  size_t sent = 0;
+  if (out.empty()) { // try to skip the queue
+    const iovec iov[2] {
+      { const_cast<char*>(head.data()), head.size() },
+      { const_cast<char*>(payload.data()), payload.size() }
+    };
+    const auto ret = sock.try_write(iov,2);
+    if (ret < 0) ++n_blocked;
+    else if (size_t(ret) == head.size() + payload.size()) return;
+    else sent = ret;
+  }
+  const size_t size = head.size() + payload.size() - sent;
+  if (!make_room(size,control)) return;
+
+  if (!owner) {
+    auto copy = std::make_shared<const std::string>(payload);
+    payload = *copy;
+    owner = std::move(copy);
+  }
+  if (out.empty()) out_sent = sent;
+  auto& f = out.emplace_back(out_frame{
+    .owner = std::move(owner),
+    .data = payload,
+    .head = { },
+    .head_size = uint8_t(head.size()),
+    .control = control
+  });
+  ::memcpy(f.head,head.data(),head.size());
+  out_bytes += size;
+  ++n_frames;
+  size_t max = n_max_bytes;
+  n_bytes += size;
+  while (out_bytes > max && !n_max_bytes.compare_exchange_weak(max,out_bytes))
+    { }
+}
+
+bool connection::make_room(size_t size, bool control) {
+  if (out_bytes + size <= max_queued_bytes && out.size() < max_queued_frames)
+    return true;
+
+  // without the frames it missed the peer couldn't inflate the rest
+  if (overflow_policy == overflow::disconnect
+    || (deflate.enabled && deflate.server_context_takeover)
+  ) {
+    ++n_disconnected;
+    hang_up_locked();
+    return false;
+  }
+
+  // the first frame can't be dropped once it's being written
+  auto it = out.begin();
+  if (it != out.end() && out_sent) ++it;
+  while (it != out.end()) {
+    if (overflow_policy == overflow::drop_oldest
+      && out_bytes + size <= max_queued_bytes
+      && out.size() < max_queued_frames
+    ) break;
+    if (it->control) { ++it; continue; }
+    out_bytes -= it->size();
+    n_bytes -= it->size();
+    --n_frames;
+    ++n_dropped;
+    it = out.erase(it);
   }
-  ::memcpy(buffer-=2,&head,2);
-  sock.write({buffer,size+2});
+  if (out_bytes + size <= max_queued_bytes && out.size() < max_queued_frames)
+    return true;
+  if (control) { // the queue is full of them, the peer pings but doesn't read
+    ++n_disconnected;
+    hang_up_locked();
+  } else ++n_dropped; // larger than the whole queue
+  return false;
+}
+
+void connection::pop_front() noexcept {
+  const size_t size = out.front().size() - out_sent;
+  out_bytes -= size;
+  n_bytes -= size;
+  --n_frames;
+  out_sent = 0;
+  out.pop_front();
+}
+
+bool connection::flush() {
+  std::lock_guard lock(mx_write);
+  return flush_locked();
+}
+
+bool connection::flush_locked() {
+  while (!out.empty()) {
+    if (closed) return true;
+    iovec iov[64];
+    int n = 0;
+    size_t skip = out_sent;
+    for (auto it = out.begin(); it != out.end() && n < 64-1; ++it) {
+      if (skip < it->head_size) {
+        iov[n++] = { it->head + skip, it->head_size - skip };
+        skip = 0;
+      } else skip -= it->head_size;
+      if (skip < it->data.size())
+        iov[n++] = {
+          const_cast<char*>(it->data.data()) + skip, it->data.size() - skip
+        };
+      skip = 0;
+    }
+    auto ret = sock.try_write(iov,n);
+    if (ret < 0) { // wait for EPOLLOUT
+      ++n_blocked;
+      return false;
+    }
+    while (!out.empty()) {
+      const size_t rest = out.front().size() - out_sent;
+      if (size_t(ret) < rest) {
+        out_sent += ret;
+        out_bytes -= ret;
+        n_bytes -= ret;
+        break;
+      }
+      ret -= rest;
+      pop_front();
+    }
+  }
+  return true;
+}
+
+size_t connection::queued_bytes() {
+  std::lock_guard lock(mx_write);
+  return out_bytes;
+}
+
+void connection::send(
+  std::shared_ptr<const void> owner, std::string_view payload,
+  head::type opcode
+) {
+  std::lock_guard lock(mx_write);
+  if (deflate.enabled && payload.size() >= deflate_min_size) {
+    thread_local std::string z;
+    if (deflate.server_context_takeover) {
+      if (!deflater) deflater = std::make_unique<zlib::deflate_stream>(
+        deflate_level, -int(deflate.server_window_bits));
+      deflate_message(*deflater,payload,z);
+      // must be sent compressed, the peer's window has to get it
+      return write(z,opcode,true);
+    }
+    deflate_once(deflate.server_window_bits,payload,z);
+    if (z.size() < payload.size()) return write(z,opcode,true);
+  }
+  write(payload,opcode,false,std::move(owner));
+}
+
+void connection::send(std::shared_ptr<const message> m) {
+  if (deflate.enabled && deflate.server_context_takeover
+    && m->data().size() >= deflate_min_size
+  ) return send(m,m->data(),m->opcode); // compressed for this connection only
+
+  const auto [head, payload] = m->frame(deflate);
+  std::lock_guard lock(mx_write);
+  enqueue(std::move(m),head,payload,false);
 }
 
 }
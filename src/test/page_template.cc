@@ -0,0 +1,102 @@
+// gzip responses of a template must inflate to the identity response,
+// including slots left without a value
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "server/page_template.hh"
+#include "zlib.hh"
+#include "scope_guard.hh"
+#include "error.hh"
+
+using namespace ivanp;
+
+namespace {
+
+std::string temp_file(const char* contents) {
+  std::string name = "/tmp/page_template.XXXXXX";
+  const int fd = PCALLR(mkstemp)(name.data());
+  scope_guard close_fd([fd]{ ::close(fd); });
+  for (std::string_view s = contents; !s.empty(); )
+    s.remove_prefix(PCALLR(write)(fd, s.data(), s.size()));
+  return name;
+}
+
+// headers and body of the response send() writes to a file
+std::pair<std::string,std::string> response(
+  const http::page_template& page, http::page_template::values vals,
+  const encoding_list& accept
+) {
+  const std::string name = temp_file("");
+  scope_guard unlink([&]{ ::unlink(name.c_str()); });
+  { const int fd = PCALLR(open)(name.c_str(), O_WRONLY);
+    scope_guard close_fd([fd]{ ::close(fd); });
+    page.send(fd, vals, accept);
+  }
+  std::string r;
+  { const int fd = PCALLR(open)(name.c_str(), O_RDONLY);
+    scope_guard close_fd([fd]{ ::close(fd); });
+    char buf[1 << 12];
+    for (size_t n; (n = PCALLR(read)(fd, buf, sizeof(buf))); )
+      r.append(buf, n);
+  }
+  const size_t body = r.find("\r\n\r\n");
+  if (body == std::string::npos) ERROR("no end of headers");
+  return { r.substr(0, body), r.substr(body+4) };
+}
+
+std::string gunzip(std::string_view z) {
+  zlib::inflate_stream zs(15|16);
+  std::string out;
+  const char* in = z.data();
+  size_t in_size = z.size();
+  for (bool end = false; !end; ) {
+    char buf[1 << 12];
+    char* p = buf;
+    size_t n = sizeof(buf);
+    end = zs(in, in_size, p, n); // throws on a bad check value
+    out.append(buf, p - buf);
+    if (!end && !in_size && p == buf) ERROR("truncated gzip stream");
+  }
+  if (in_size) ERROR("data after the gzip stream");
+  return out;
+}
+
+}
+
+int main() {
+  const std::string name = temp_file(
+    "<p><!-- html:a --></p>\n"
+    "<script>x = '<!-- js:b -->'</script>\n"
+    "<!-- raw:x --><!-- raw:y -->end\n");
+  scope_guard unlink([&]{ ::unlink(name.c_str()); });
+  const http::page_template page(name.c_str());
+
+  const std::string big(70000, 'z'); // more than one stored block
+  const http::page_template::values cases[] {
+    { },
+    { { "a", "<b>" } },
+    { { "x", "raw" } },
+    { { "a", "&" }, { "b", "it's" }, { "y", big } },
+  };
+  int failed = 0;
+  for (const auto& vals : cases) {
+    const auto [head, text] = response(page, vals, { });
+    const auto [zhead, z] = response(page, vals, { encoding::gzip });
+    try {
+      if (zhead.find("Content-Encoding: gzip") == std::string::npos)
+        ERROR("not gzipped");
+      if (gunzip(z) != text) ERROR("inflates to a different page");
+    } catch (const std::exception& e) {
+      std::cerr << "values";
+      for (const auto& [k,v] : vals) std::cerr << ' ' << k;
+      std::cerr << ": " << e.what() << std::endl;
+      ++failed;
+    }
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -11,6 +11,10 @@
 
 #include <algorithm>
 #include <bit>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <exception>
 
 #include "scope_guard.hh"
 #include "error.hh"
@@ -54,7 +58,7 @@ void deflate_alloc(
     Z_DEFAULT_STRATEGY
   )) != Z_OK) ERROR("deflateInit2(): ",zerrmsg(ret));
 
-  scope_guard deflate_end([&]{ (void)::deflateEnd(&zs); });
+  ivanp::scope_guard deflate_end([&]{ (void)::deflateEnd(&zs); });
 
   zs.next_in = reinterpret_cast<const unsigned char*>(in);
   zs.avail_in = in_size;
@@ -80,4 +84,247 @@ void deflate_alloc(
   out = reinterpret_cast<char*>(realloc(out,(out_size = used - zs.avail_out)));
 }
 
+void deflate_parallel(
+  const char* in, size_t in_size,
+  char*& out, size_t& out_size,
+  unsigned nthreads, size_t block_size
+) {
+  // pigz: blocks are compressed independently as raw deflate, each primed
+  // with the 32 KiB window preceding it, and all but the last are ended
+  // with a sync flush, so that their concatenation is one deflate stream
+  static constexpr size_t window = 1 << 15;
+  if (block_size < window) block_size = window;
+  const size_t nblocks = std::max(in_size/block_size + (in_size%block_size != 0),
+    size_t(1));
+  if (nthreads == 0) nthreads = std::thread::hardware_concurrency();
+  nthreads = std::min<size_t>(std::max(nthreads,1u), nblocks);
+
+  struct block {
+    std::vector<unsigned char> z;
+    uLong crc;
+    size_t size;
+  };
+  std::vector<block> blocks(nblocks);
+  std::atomic<size_t> next = 0;
+  std::exception_ptr err;
+  std::atomic_flag failed;
+
+  const auto worker = [&]{
+    try {
+      z_stream zs;
+      zs.zalloc = Z_NULL;
+      zs.zfree = Z_NULL;
+      zs.opaque = Z_NULL;
+      int ret;
+      if ((ret = ::deflateInit2(
+        &zs, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY
+      )) != Z_OK) ERROR("deflateInit2(): ",zerrmsg(ret));
+      ivanp::scope_guard deflate_end([&]{ (void)::deflateEnd(&zs); });
+
+      for (size_t i; (i = next++) < nblocks && !failed.test(); ) {
+        const size_t a = i*block_size, n = std::min(block_size,in_size-a);
+        const auto* p = reinterpret_cast<const unsigned char*>(in + a);
+        const bool last = i+1 == nblocks;
+        auto& b = blocks[i];
+
+        (void)::deflateReset(&zs);
+        if (i) if ((ret = ::deflateSetDictionary(&zs, p-window, window))
+          != Z_OK) ERROR("deflateSetDictionary(): ",zerrmsg(ret));
+
+        b.size = n;
+        b.crc = ::crc32(0, p, n);
+        b.z.resize(::deflateBound(&zs,n) + 16); // + sync flush marker
+        zs.next_in = p;
+        zs.avail_in = n;
+        zs.next_out = b.z.data();
+        zs.avail_out = b.z.size();
+        ret = ::deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (ret != (last ? Z_STREAM_END : Z_OK) || zs.avail_in != 0)
+          ERROR("deflate(): ",zerrmsg(ret));
+        b.z.resize(b.z.size() - zs.avail_out);
+      }
+    } catch (...) {
+      if (!failed.test_and_set()) err = std::current_exception();
+    }
+  };
+  { std::vector<std::jthread> threads;
+    threads.reserve(nthreads-1);
+    for (unsigned i=1; i<nthreads; ++i) threads.emplace_back(worker);
+    worker();
+  }
+  if (err) std::rethrow_exception(err);
+
+  // gzip header, no file name or time
+  static constexpr unsigned char head[10] = {
+    0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+  size_t size = sizeof(head) + 8;
+  uLong crc = blocks[0].crc;
+  for (size_t i=0; i<nblocks; ++i) {
+    size += blocks[i].z.size();
+    if (i) crc = ::crc32_combine(crc, blocks[i].crc, blocks[i].size);
+  }
+  out = reinterpret_cast<char*>(realloc(out,(out_size = size)));
+  if (!out) THROW_ERRNO("realloc()");
+
+  char* o = out;
+  o = std::copy_n(reinterpret_cast<const char*>(head), sizeof(head), o);
+  for (const auto& b : blocks)
+    o = std::copy(b.z.begin(), b.z.end(), o);
+  const uint32_t trailer[2] = { uint32_t(crc), uint32_t(in_size) };
+  for (uint32_t x : trailer) // little endian
+    for (int i=0; i<4; ++i) *o++ = char(x >> (8*i));
+}
+
+void deflate_splice(
+  const char* in, size_t in_size,
+  char*& out, size_t& out_size
+) {
+  z_stream zs;
+  zs.zalloc = Z_NULL;
+  zs.zfree = Z_NULL;
+  zs.opaque = Z_NULL;
+  int ret;
+  if ((ret = ::deflateInit2(
+    &zs, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY
+  )) != Z_OK) ERROR("deflateInit2(): ",zerrmsg(ret));
+  ivanp::scope_guard deflate_end([&]{ (void)::deflateEnd(&zs); });
+
+  const size_t size = ::deflateBound(&zs,in_size) + 16; // + sync flush marker
+  out = reinterpret_cast<char*>(realloc(out,size));
+  if (!out) THROW_ERRNO("realloc()");
+  zs.next_in = reinterpret_cast<const unsigned char*>(in);
+  zs.avail_in = in_size;
+  zs.next_out = reinterpret_cast<unsigned char*>(out);
+  zs.avail_out = size;
+  ret = ::deflate(&zs, Z_SYNC_FLUSH);
+  if (ret != Z_OK || zs.avail_in != 0) ERROR("deflate(): ",zerrmsg(ret));
+  out = reinterpret_cast<char*>(realloc(out,(out_size = size - zs.avail_out)));
+}
+
+unsigned long crc32(unsigned long crc, const char* in, size_t in_size) {
+  return ::crc32_z(crc, reinterpret_cast<const unsigned char*>(in), in_size);
+}
+
+unsigned long crc32_combine(
+  unsigned long crc1, unsigned long crc2, size_t len2
+) {
+  return ::crc32_combine(crc1, crc2, len2);
+}
+
+deflate_stream::deflate_stream(int level, int window_bits, int mem_level)
+: zs(new z_stream { })
+{
+  z_stream& zs = *static_cast<z_stream*>(this->zs);
+  zs.zalloc = Z_NULL;
+  zs.zfree = Z_NULL;
+  zs.opaque = Z_NULL;
+  int ret;
+  if ((ret = ::deflateInit2(
+    &zs, level, Z_DEFLATED, window_bits, mem_level, Z_DEFAULT_STRATEGY
+  )) != Z_OK) {
+    delete &zs;
+    ERROR("deflateInit2(): ",zerrmsg(ret));
+  }
+}
+deflate_stream::~deflate_stream() {
+  z_stream* const zs = static_cast<z_stream*>(this->zs);
+  (void)::deflateEnd(zs);
+  delete zs;
+}
+
+deflate_stream& deflate_stream::local() {
+  thread_local deflate_stream zs;
+  return zs;
+}
+
+void deflate_stream::reset() {
+  int ret;
+  if ((ret = ::deflateReset(static_cast<z_stream*>(zs))) != Z_OK)
+    ERROR("deflateReset(): ",zerrmsg(ret));
+}
+
+bool deflate_stream::operator()(
+  const char*& in, size_t& in_size,
+  char*& out, size_t& out_size,
+  bool finish
+) {
+  z_stream& zs = *static_cast<z_stream*>(this->zs);
+  static constexpr size_t max = uInt(-1);
+  const size_t nin = std::min(in_size,max), nout = std::min(out_size,max);
+  zs.next_in = reinterpret_cast<const unsigned char*>(in);
+  zs.avail_in = nin;
+  zs.next_out = reinterpret_cast<unsigned char*>(out);
+  zs.avail_out = nout;
+  const int ret = ::deflate(&zs,
+    finish && nin == in_size ? Z_FINISH : Z_NO_FLUSH);
+  if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+    ERROR("deflate(): ",zerrmsg(ret));
+  in += nin - zs.avail_in;
+  in_size -= nin - zs.avail_in;
+  out += nout - zs.avail_out;
+  out_size -= nout - zs.avail_out;
+  return ret == Z_STREAM_END;
+}
+
+bool deflate_stream::sync_flush(char*& out, size_t& out_size) {
+  z_stream& zs = *static_cast<z_stream*>(this->zs);
+  const size_t nout = std::min(out_size,size_t(uInt(-1)));
+  zs.next_in = nullptr;
+  zs.avail_in = 0;
+  zs.next_out = reinterpret_cast<unsigned char*>(out);
+  zs.avail_out = nout;
+  const int ret = ::deflate(&zs,Z_SYNC_FLUSH);
+  if (ret != Z_OK && ret != Z_BUF_ERROR)
+    ERROR("deflate(): ",zerrmsg(ret));
+  out += nout - zs.avail_out;
+  out_size -= nout - zs.avail_out;
+  return zs.avail_out != 0;
+}
+
+inflate_stream::inflate_stream(int window_bits)
+: zs(new z_stream { })
+{
+  z_stream& zs = *static_cast<z_stream*>(this->zs);
+  zs.zalloc = Z_NULL;
+  zs.zfree = Z_NULL;
+  zs.opaque = Z_NULL;
+  int ret;
+  if ((ret = ::inflateInit2(&zs, window_bits)) != Z_OK) {
+    delete &zs;
+    ERROR("inflateInit2(): ",zerrmsg(ret));
+  }
+}
+inflate_stream::~inflate_stream() {
+  z_stream* const zs = static_cast<z_stream*>(this->zs);
+  (void)::inflateEnd(zs);
+  delete zs;
+}
+
+void inflate_stream::reset() {
+  int ret;
+  if ((ret = ::inflateReset(static_cast<z_stream*>(zs))) != Z_OK)
+    ERROR("inflateReset(): ",zerrmsg(ret));
+}
+
+bool inflate_stream::operator()(
+  const char*& in, size_t& in_size,
+  char*& out, size_t& out_size
+) {
+  z_stream& zs = *static_cast<z_stream*>(this->zs);
+  static constexpr size_t max = uInt(-1);
+  const size_t nin = std::min(in_size,max), nout = std::min(out_size,max);
+  zs.next_in = reinterpret_cast<const unsigned char*>(in);
+  zs.avail_in = nin;
+  zs.next_out = reinterpret_cast<unsigned char*>(out);
+  zs.avail_out = nout;
+  const int ret = ::inflate(&zs,Z_SYNC_FLUSH);
+  if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+    ERROR("inflate(): ",zerrmsg(ret));
+  in += nin - zs.avail_in;
+  in_size -= nin - zs.avail_in;
+  out += nout - zs.avail_out;
+  out_size -= nout - zs.avail_out;
+  return ret == Z_STREAM_END;
+}
+
 } // end namespace zlib
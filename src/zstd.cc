@@ -0,0 +1,41 @@
+#include "zstd.hh"
+
+#include <cstdlib>
+
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define IVANP_HAVE_ZSTD
+#endif
+
+#include "error.hh"
+
+namespace zstd {
+
+#ifdef IVANP_HAVE_ZSTD
+
+const bool available = true;
+
+void compress_alloc(
+  const char* in, size_t in_size,
+  char*& out, size_t& out_size,
+  int level
+) {
+  size_t size = ::ZSTD_compressBound(in_size);
+  out = reinterpret_cast<char*>(realloc(out,size));
+  if (!out) THROW_ERRNO("realloc()");
+  size = ::ZSTD_compress(out, size, in, in_size, level);
+  if (::ZSTD_isError(size)) ERROR("ZSTD_compress(): ",::ZSTD_getErrorName(size));
+  out = reinterpret_cast<char*>(realloc(out,(out_size = size)));
+}
+
+#else
+
+const bool available = false;
+
+void compress_alloc(const char*, size_t, char*&, size_t&, int) {
+  ERROR("built without zstd");
+}
+
+#endif
+
+}